@@ -1,31 +1,810 @@
 #include <iostream>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <limits>
 #include "sqlite3.h"
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <shared_mutex>
+#include <unordered_map>
+#include <map>
+#include <random>
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX // keep windows.h from defining min and max over std::min/std::max
+#include <winsock2.h>
+#include <ws2tcpip.h>
 
 #pragma comment(lib, "Ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <csignal>
+#include <cerrno>
+
+// POSIX stand-ins for the Winsock names used throughout the server
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_BOTH SHUT_RDWR
+#define closesocket close
+#define WSAGetLastError() errno
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define HAVE_EPOLL 1
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #define SERVER_PORT 5432
-#define MAX_PENDING 5
-#define MAX_LINE 1024
+#define DATABASE_FILE "pokemon_store.db"
+#define MAX_PENDING 1024 // listen backlog; the kernel may cap it (somaxconn)
+#define MAX_CONNECTIONS 10000 // clients served at once; past this, new ones get "503 Busy" and are closed
+#define FD_RESERVE 16 // descriptors kept back from clients: stdio, the listener, the writer database, the spare
+#define READER_FDS 3  // a reader connection holds the database, its -wal and its -shm open
+#define ACCEPT_RETRY_MS 100 // out of descriptors with no spare to shed with: pause accepting this long
+#define MAX_LINE 65536 // longest command accepted before the connection is dropped
+#define RECV_BUFFER_SIZE 4096
+#define OUTPUT_CHUNK_SIZE 16384
+#define OUTPUT_HIGH_WATER 262144 // stop running commands while this much output is unsent
+#define OUTPUT_LOW_WATER 65536   // ...and start again once it drains below this
+#define OUTPUT_SPARE_CHUNKS 4    // written-out chunk buffers each connection keeps for reuse
+#define MAX_IOVECS 64
+#define SESSION_SLAB_SIZE 64 // sessions allocated together when the pool runs dry
+#define SHARED_REPLY_MIN 2048 // smaller prebuilt replies are copied rather than given a buffer of their own
 #define PRICE_PER_CARD 50.0
+#define LIST_PAGE_DEFAULT 100 // rows per page when a paged LIST gives no limit
+#define LIST_PAGE_MAX 1000
+#define BATCH_MAX_COMMANDS 256 // most commands one BATCH block may hold
+#define CHECKOUT_MAX_ITEMS 100  // most (card, quantity) pairs in one CHECKOUT
+#define WRITE_BATCH_SIZE 256    // most mutations committed in one transaction
+#define WRITE_BATCH_DELAY_US 0  // how long the writer waits for a batch to fill; 0 = commit as soon as it is free
+#define PERSIST_PRESENCE 0      // 1 = also keep Users.logged_in up to date, through the writer
+#define SESSION_TOKEN_TTL_S 86400 // how long after its last use a LOGIN token can still be resumed
+#define HASH_THREADS 2          // threads checking passwords, apart from the network and DB threads
+#define HASH_QUEUE_MAX 1024     // logins waiting for a hashing thread before more are turned away
+#define PASSWORD_HASH_ITERATIONS 100000 // PBKDF2 rounds for stored passwords
+#define RATE_LOGIN_PER_S 20     // token buckets per client address and per user, by command class:
+#define RATE_LOGIN_BURST 100    // requests per second and bucket size, 0 per second = unlimited
+#define RATE_READ_PER_S 0
+#define RATE_READ_BURST 0
+#define RATE_LIST_PER_S 50
+#define RATE_LIST_BURST 100
+#define RATE_WRITE_PER_S 0
+#define RATE_WRITE_BURST 0
+#define RATE_TABLE_SWEEP 4096   // buckets kept before idle, refilled ones are dropped
+#define MAX_EPOLL_EVENTS 256
+#define URING_ENTRIES 1024
+#define URING_BUFFER_COUNT 1024
+#define URING_BUFFER_SIZE 4096
+#define URING_DRAIN_TIMEOUT_S 1 // how long shutdown waits for the sends in flight
+
+#ifdef HAVE_EPOLL
+#define DEFAULT_BACKEND "epoll"
+#else
+#define DEFAULT_BACKEND "threads"
+#endif
+
+// What a command counts against in the rate limiter
+enum RateClass {
+    RATE_LOGIN, // LOGIN, RESUME
+    RATE_READ,  // BALANCE, LOOKUP, WHO, STATS
+    RATE_LIST,
+    RATE_WRITE, // DEPOSIT, BUY, SELL, CHECKOUT, a whole BATCH
+    RATE_CLASSES,
+    RATE_EXEMPT = RATE_CLASSES // QUIT, LOGOUT, HELLO, ...
+};
+
+struct RateLimit {
+    double perSecond; // 0 = unlimited
+    double burst;
+};
+
+struct ServerConfig {
+    std::string backend = DEFAULT_BACKEND;
+    unsigned eventLoopThreads = 0; // 0 = one per hardware thread
+    unsigned writeBatchSize = WRITE_BATCH_SIZE;
+    unsigned writeBatchDelayMicros = WRITE_BATCH_DELAY_US;
+    bool persistPresence = PERSIST_PRESENCE;
+    unsigned sessionTokenSeconds = SESSION_TOKEN_TTL_S;
+    unsigned hashThreads = HASH_THREADS;
+    unsigned hashIterations = PASSWORD_HASH_ITERATIONS;
+    unsigned maxConnections = MAX_CONNECTIONS;
+    unsigned backlog = MAX_PENDING;
+    RateLimit rateLimits[RATE_CLASSES] = {
+        { RATE_LOGIN_PER_S, RATE_LOGIN_BURST },
+        { RATE_READ_PER_S, RATE_READ_BURST },
+        { RATE_LIST_PER_S, RATE_LIST_BURST },
+        { RATE_WRITE_PER_S, RATE_WRITE_BURST }
+    };
+    unsigned long benchParserPasses = 0; // when set, time the command parser instead of serving
+};
+
+#ifdef _WIN32
+typedef WSABUF IoBuffer;
+#else
+typedef iovec IoBuffer;
+#endif
+
+// Replies waiting to be written to one client. Small replies are packed into
+// shared chunks so everything produced by one batch of input goes out in a
+// single gathered write, and short writes just advance the read position.
+// Prebuilt replies are queued by reference instead of being copied. Chunk
+// buffers are reused once written, so a connection stops allocating after
+// its first few replies.
+class OutputQueue {
+public:
+    typedef std::shared_ptr<const std::string> SharedBuffer;
+
+    void append(const char* data, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        if (chunks.empty() || chunks.back().sealed || chunks.back().data.size() >= OUTPUT_CHUNK_SIZE) {
+            chunks.emplace_back();
+            if (!spare.empty()) {
+                chunks.back().data = std::move(spare.back());
+                spare.pop_back();
+            }
+        }
+        chunks.back().data.append(data, length);
+        bytes += length;
+    }
+
+    void append(const SharedBuffer& buffer) {
+        if (buffer->size() < SHARED_REPLY_MIN) {
+            append(buffer->data(), buffer->size());
+            return;
+        }
+        chunks.emplace_back();
+        chunks.back().shared = buffer;
+        chunks.back().sealed = true;
+        bytes += buffer->size();
+    }
+
+    bool empty() const {
+        return bytes == 0;
+    }
+
+    size_t size() const {
+        return bytes;
+    }
+
+    // Describes up to maxBuffers pending chunks for writev/WSASend
+    int gather(IoBuffer* buffers, int maxBuffers) const {
+        int count = 0;
+        size_t offset = headOffset;
+        for (auto it = chunks.begin(); it != chunks.end() && count < maxBuffers; ++it) {
+#ifdef _WIN32
+            buffers[count].buf = const_cast<char*>(it->contents().data() + offset);
+            buffers[count].len = (ULONG)(it->contents().size() - offset);
+#else
+            buffers[count].iov_base = const_cast<char*>(it->contents().data() + offset);
+            buffers[count].iov_len = it->contents().size() - offset;
+#endif
+            count++;
+            offset = 0;
+        }
+        return count;
+    }
+
+    // Stops later appends from touching chunks an asynchronous send still points at
+    void seal() {
+        for (auto& chunk : chunks) {
+            chunk.sealed = true;
+        }
+    }
+
+    void consume(size_t length) {
+        bytes -= length;
+        while (length > 0) {
+            size_t available = chunks.front().contents().size() - headOffset;
+            if (length < available) {
+                headOffset += length;
+                return;
+            }
+            length -= available;
+            headOffset = 0;
+            Chunk& written = chunks.front();
+            if (written.data.capacity() > 2 * OUTPUT_CHUNK_SIZE) {
+                std::string().swap(written.data); // left over from one oversized reply
+            }
+            written.data.clear();
+            if (chunks.size() == 1 && !written.shared) {
+                // Nothing else is queued and no send points at it any more:
+                // keep it as the next chunk, so the deque does not churn either
+                written.sealed = false;
+            }
+            else {
+                if (spare.size() < OUTPUT_SPARE_CHUNKS && written.data.capacity() > 0) {
+                    spare.push_back(std::move(written.data));
+                }
+                chunks.pop_front();
+            }
+        }
+    }
+
+private:
+    struct Chunk {
+        std::string data;
+        SharedBuffer shared; // set instead of data for a prebuilt reply
+        bool sealed = false;
+
+        const std::string& contents() const {
+            return shared ? *shared : data;
+        }
+    };
+
+    std::deque<Chunk> chunks;
+    std::vector<std::string> spare; // emptied chunk buffers, capacity kept
+    size_t headOffset = 0;
+    size_t bytes = 0;
+};
+
+// A filtered LIST: optional filters, a page size and where the last page ended
+struct ListQuery {
+    std::string type;
+    std::string rarity;
+    std::string prefix;
+    size_t limit = LIST_PAGE_DEFAULT;
+    std::string cursor; // from the previous page's "Next cursor:" line; empty for the first page
+    bool stream = false; // send every matching row instead of one page
+};
+
+// A LIST being streamed out a slice at a time as the connection's output drains
+struct ListStream {
+    ListQuery query;
+    int after = 0; // ID of the last card sent
+    bool started = false;
+};
+
+// Outcome of a mutation run by the writer thread
+struct WriteResult {
+    explicit WriteResult(std::string_view reply) : reply(reply) {}
+
+    std::string_view reply; // always a string literal
+    std::string replies; // built at run time (a BATCH's results, a CHECKOUT failure); sent instead of reply
+    bool login = false;   // a LOGIN checked by the hashing threads, not a write
+    int userId = -1;      // for a login whose password matched: the user...
+    bool root = false;    // ...their is_root flag
+    std::string username; // ...and name
+};
+
+class CompletionQueue;
+struct WriteRequest;
+
+// 128 random bits handed out by LOGIN, written as 32 hex digits. All zero is no token.
+struct SessionToken {
+    uint64_t high = 0;
+    uint64_t low = 0;
+
+    bool operator==(const SessionToken& other) const {
+        return high == other.high && low == other.low;
+    }
+
+    bool empty() const {
+        return high == 0 && low == 0;
+    }
+
+    // Writes the 32 digits to text
+    void format(char* text) const {
+        static const char digits[] = "0123456789abcdef";
+        for (int i = 0; i < 16; i++) {
+            text[i] = digits[(high >> (60 - 4 * i)) & 0xf];
+            text[16 + i] = digits[(low >> (60 - 4 * i)) & 0xf];
+        }
+    }
+
+    // False unless text is exactly 32 hex digits
+    static bool parse(std::string_view text, SessionToken& token) {
+        if (text.size() != 32) {
+            return false;
+        }
+        const char* middle = text.data() + 16;
+        const char* end = text.data() + 32;
+        return std::from_chars(text.data(), middle, token.high, 16).ptr == middle
+            && std::from_chars(middle, end, token.low, 16).ptr == end;
+    }
+};
+
+struct SessionTokenHash {
+    size_t operator()(const SessionToken& token) const {
+        return (size_t)(token.low ^ token.high); // random already
+    }
+};
+
+struct RateBuckets;
+
+// Who is logged in on a connection, and what the connection has done.
+// Filled in from the LOGIN reply, so checks on the user are field reads.
+struct Session {
+    int userId = -1;
+    bool root = false;
+    std::string username; // kept from LOGIN
+    SessionToken token;   // from LOGIN or RESUME; LOGOUT revokes it
+    std::shared_ptr<RateBuckets> userLimits; // shared by every session of the user
+    unsigned long long commands = 0;
+    unsigned long long writes = 0; // mutations committed for this session
+
+    // Back to a fresh session; the username keeps its buffer for the next user
+    void reset() {
+        userId = -1;
+        root = false;
+        username.clear();
+        token = SessionToken();
+        userLimits.reset();
+        commands = 0;
+        writes = 0;
+    }
+};
+
+// Sessions are carved out of slabs of SESSION_SLAB_SIZE and recycled through
+// a free list, so connections coming and going stop allocating once the pool
+// has grown to the peak number of connections.
+class SessionPool {
+public:
+    Session* acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle.empty()) {
+            slabs.emplace_back(new Session[SESSION_SLAB_SIZE]);
+            for (size_t i = SESSION_SLAB_SIZE; i-- > 0;) {
+                idle.push_back(&slabs.back()[i]);
+            }
+        }
+        Session* session = idle.back();
+        idle.pop_back();
+        return session;
+    }
+
+    void release(Session* session) {
+        session->reset();
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(session);
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Session[]>> slabs;
+    std::vector<Session*> idle;
+};
+
+SessionPool sessions;
+
+std::atomic<unsigned long long> connectionsShed(0);
+
+// Caps how many clients are served at once. A socket past the cap is told
+// the server is busy and closed on the spot, before anything is set up for
+// it, so an overload costs the admitted clients next to nothing.
+class ConnectionLimit {
+public:
+    void setMaximum(unsigned connections) {
+        maximum = connections;
+    }
+
+    // Takes a slot for a socket just accepted; false once it has been shed
+    bool admit(SOCKET socket) {
+        if (active.fetch_add(1) < maximum) {
+            return true;
+        }
+        active--;
+        shed(socket);
+        return false;
+    }
+
+    // Keeps a descriptor in reserve, so a client can still be accepted and
+    // turned away once the process has run out of them
+    void reserveSpare() {
+#ifndef _WIN32
+        std::lock_guard<std::mutex> lock(spareMutex);
+        if (spare < 0) {
+            spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+#endif
+    }
+
+    // accept() failed for want of descriptors: gives up the spare to accept
+    // and shed every client waiting, then takes the spare back. accept() fails
+    // so even with nobody waiting, so callers must not retry at once. False
+    // when there was no spare and nobody could be told.
+    bool shedWithSpare(SOCKET listener) {
+#ifdef _WIN32
+        (void)listener;
+        return false;
+#else
+        std::lock_guard<std::mutex> lock(spareMutex);
+        if (spare < 0) {
+            spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (spare < 0) {
+                return false;
+            }
+        }
+        close(spare);
+        // The listener may be blocking; only accept while a client is waiting
+        pollfd waiting = { listener, POLLIN, 0 };
+        while (poll(&waiting, 1, 0) == 1 && (waiting.revents & POLLIN)) {
+            SOCKET socket = accept(listener, nullptr, nullptr);
+            if (socket == INVALID_SOCKET) {
+                break;
+            }
+            shed(socket);
+        }
+        spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return true;
+#endif
+    }
+
+    void release() {
+        active--;
+    }
+
+    unsigned long long count() const {
+        return active.load();
+    }
+
+private:
+    void shed(SOCKET socket) {
+        connectionsShed++;
+        static const char busy[] = "503 Busy - Too many connections\n";
+        send(socket, busy, sizeof(busy) - 1, 0);
+        closesocket(socket);
+    }
+
+    std::atomic<unsigned> active{ 0 };
+    unsigned maximum = MAX_CONNECTIONS;
+    std::mutex spareMutex;
+    int spare = -1;
+};
+
+ConnectionLimit connectionLimit;
+
+void logOut(Session& session);
+
+// State kept for each client socket, independent of which backend drives it.
+// Only made for sockets the ConnectionLimit admitted; it gives the slot back.
+struct Connection {
+    Connection() : session(sessions.acquire()) {}
+
+    ~Connection() {
+        logOut(*session); // a dropped connection leaves WHO like a LOGOUT
+        sessions.release(session);
+        connectionLimit.release();
+    }
+
+    SOCKET socket;
+    Session* session;
+    std::shared_ptr<RateBuckets> addressLimits; // shared by every connection from the client's address
+    std::string input;  // bytes received but not yet framed into a full command
+    OutputQueue output; // replies waiting to be written by the backend
+    CompletionQueue* completions = nullptr; // where the writer hands back this connection's results
+    std::unique_ptr<ListStream> listing;    // runs before any later command
+    bool paused = false;  // output passed the high-water mark, input is left unprocessed
+    bool closing = false; // close once the queued output has been written
+    bool awaitingWrite = false; // a mutation is with the writer; later commands wait for its reply
+    bool sendPending = false; // an io_uring send still points at the sealed output
+    std::unique_ptr<WriteRequest> batch; // commands collected between BATCH and END
+    bool batchTooLarge = false; // more than BATCH_MAX_COMMANDS; the block is refused at END
+    bool binary = false; // switched to framed binary requests by HELLO BINARY
+    uint16_t pendingOpcode = 0; // binary request whose write is with the writer
+};
+
+// Results posted by the writer thread for the connections of one backend
+// thread. Event loops get woken through notify and take them in bulk, the
+// thread-per-connection backend blocks in wait().
+class CompletionQueue {
+public:
+    struct Completion {
+        Connection* conn;
+        WriteResult result;
+    };
+
+    explicit CompletionQueue(std::function<void()> notify = nullptr) : notify(notify) {}
+
+    // Notifies under the lock: a waiting thread may destroy the queue as soon as it is released
+    void post(Connection* conn, WriteResult result) {
+        std::lock_guard<std::mutex> lock(mutex);
+        completions.push_back(Completion{ conn, std::move(result) });
+        posted.notify_one();
+        if (notify) {
+            notify();
+        }
+    }
+
+    void take(std::vector<Completion>& taken) {
+        std::lock_guard<std::mutex> lock(mutex);
+        taken.insert(taken.end(), std::make_move_iterator(completions.begin()), std::make_move_iterator(completions.end()));
+        completions.clear();
+    }
+
+    Completion wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        posted.wait(lock, [this] { return !completions.empty(); });
+        Completion completion = std::move(completions.front());
+        completions.erase(completions.begin());
+        return completion;
+    }
+
+private:
+    std::function<void()> notify;
+    std::mutex mutex;
+    std::condition_variable posted;
+    std::vector<Completion> completions;
+};
 
 SOCKET serverSocket;
 std::mutex db_mutex;
+std::atomic<bool> serverRunning(true);
+
+bool startupSockets() {
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        std::cerr << "Failed to initialize Winsock. Error: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+#else
+    // A client closing mid-reply must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    return true;
+}
+
+void cleanupSockets() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+bool setNonBlocking(SOCKET sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+bool outOfDescriptors(int error) {
+#ifdef _WIN32
+    return error == WSAEMFILE;
+#else
+    return error == EMFILE || error == ENFILE;
+#endif
+}
+
+// Logs a failed accept at most once a second; in an overload it can fail
+// for every client that knocks
+void reportAcceptFailure(int error) {
+    static std::atomic<long long> nextReport(0);
+    static std::atomic<unsigned long long> unreported(0);
+    long long now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    long long due = nextReport.load();
+    if (now < due || !nextReport.compare_exchange_strong(due, now + 1)) {
+        unreported++;
+        return;
+    }
+    std::cerr << "Accept failed: " << error;
+    unsigned long long skipped = unreported.exchange(0);
+    if (skipped > 0) {
+        std::cerr << " (" << skipped << " more since the last report)";
+    }
+    std::cerr << std::endl;
+}
+
+#ifndef _WIN32
+// Raises the descriptor limit as far as the hard limit allows and keeps the
+// connection cap within it, so a full house is shed with 503 by the
+// ConnectionLimit rather than failing accept()
+void fitDescriptorLimit(ServerConfig& config) {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        rlim_t wanted = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            limit.rlim_cur = wanted;
+        }
+    }
+    // Each event loop holds a reader, an epoll or ring descriptor and an
+    // eventfd; the thread-per-connection backend holds a reader per client
+    rlim_t perClient = config.backend == "threads" ? 1 + READER_FDS : 1;
+    rlim_t reserved = FD_RESERVE + (rlim_t)config.eventLoopThreads * (READER_FDS + 2);
+    rlim_t fits = limit.rlim_cur > reserved ? (limit.rlim_cur - reserved) / perClient : 1;
+    if (config.maxConnections > fits) {
+        std::cout << "Serving at most " << fits << " connections to stay within " << limit.rlim_cur << " open files." << std::endl;
+        config.maxConnections = (unsigned)fits;
+    }
+}
+#endif
+
+void requestShutdown();
+
+// First lines of the multi-line replies
+constexpr std::string_view CARDS_HEADER = "200 OK - Available Pokmon cards:\n";
+constexpr std::string_view CARD_DETAILS_HEADER = "200 OK - Card details:\n";
+constexpr std::string_view USERS_HEADER = "200 OK - Logged-in users:\n";
+constexpr std::string_view STATS_HEADER = "200 OK - Server statistics:\n";
+constexpr std::string_view BALANCE_PREFIX = "200 OK - Your balance is ";
+
+// Formats a reply straight into an OutputQueue or a std::string, with no
+// stream or temporary strings. Numbers go through std::to_chars and come out
+// as operator<< would write them.
+template <typename Output>
+class ReplyWriter {
+public:
+    explicit ReplyWriter(Output& out) : out(out) {}
+
+    ReplyWriter& operator<<(std::string_view text) {
+        out.append(text.data(), text.size());
+        return *this;
+    }
+
+    ReplyWriter& operator<<(int value) {
+        return integer(value);
+    }
+
+    ReplyWriter& operator<<(long long value) {
+        return integer(value);
+    }
+
+    ReplyWriter& operator<<(unsigned long long value) {
+        return integer(value);
+    }
+
+    // Six significant digits, the default precision of a stream
+    ReplyWriter& operator<<(double value) {
+        char text[32];
+        std::to_chars_result result = std::to_chars(text, text + sizeof(text), value, std::chars_format::general, 6);
+        out.append(text, result.ptr - text);
+        return *this;
+    }
+
+private:
+    template <typename Integer>
+    ReplyWriter& integer(Integer value) {
+        char text[24];
+        std::to_chars_result result = std::to_chars(text, text + sizeof(text), value);
+        out.append(text, result.ptr - text);
+        return *this;
+    }
+
+    Output& out;
+};
+
+void queueReply(Connection& conn, std::string_view reply) {
+    conn.output.append(reply.data(), reply.size());
+}
+
+void queueReply(Connection& conn, const OutputQueue::SharedBuffer& reply) {
+    conn.output.append(reply);
+}
+
+// Writes as much queued output as the socket takes, one gathered write per
+// pass. On a blocking socket this drains the queue. Returns false on a socket error.
+bool writeOutput(Connection& conn) {
+    IoBuffer buffers[MAX_IOVECS];
+    while (!conn.output.empty()) {
+        int count = conn.output.gather(buffers, MAX_IOVECS);
+#ifdef _WIN32
+        DWORD sent = 0;
+        if (WSASend(conn.socket, buffers, count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+#else
+        msghdr msg = {};
+        msg.msg_iov = buffers;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(conn.socket, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+#endif
+        conn.output.consume(sent);
+    }
+    return true;
+}
+
+// Schema changes applied on top of the base tables, in order. PRAGMA
+// user_version records how many have run. Each step commits together with
+// its version bump, so a failed step leaves the database at the previous
+// version. Only ever append to this list.
+const char* const migrations[] = {
+    // 1: LOOKUP, BUY and SELL filter cards by name and owner
+    "CREATE INDEX IF NOT EXISTS idx_cards_name_owner ON Pokemon_Cards(card_name, owner_id);",
+    // 2: LOGIN finds users by name, and a name may only be taken once
+    "CREATE UNIQUE INDEX IF NOT EXISTS idx_users_username ON Users(username);",
+    // 3: owned cards move from one Pokemon_Cards row per purchase to one
+    // Holdings row per user and catalog card. Owned rows whose name has no
+    // catalog entry are left where they are.
+    "CREATE TABLE Holdings ("
+    "owner_id INTEGER NOT NULL REFERENCES Users(ID), "
+    "card_id INTEGER NOT NULL REFERENCES Pokemon_Cards(ID), "
+    "count INTEGER NOT NULL, "
+    "PRIMARY KEY (owner_id, card_id)) WITHOUT ROWID;"
+    "INSERT INTO Holdings (owner_id, card_id, count) "
+    "SELECT owner_id, card_id, SUM(count) FROM ("
+    "SELECT owned.owner_id, owned.count, (SELECT MIN(stock.ID) FROM Pokemon_Cards stock "
+    "WHERE stock.card_name = owned.card_name AND stock.owner_id IS NULL) AS card_id "
+    "FROM Pokemon_Cards owned WHERE owned.owner_id IS NOT NULL) "
+    "WHERE card_id IS NOT NULL GROUP BY owner_id, card_id HAVING SUM(count) > 0;"
+    "DELETE FROM Pokemon_Cards WHERE owner_id IS NOT NULL AND card_name IN "
+    "(SELECT card_name FROM Pokemon_Cards WHERE owner_id IS NULL);",
+};
+
+const int schemaVersion = sizeof(migrations) / sizeof(migrations[0]);
+
+bool migrateDatabase(sqlite3* db) {
+    int version = 0;
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            version = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    if (version > schemaVersion) {
+        std::cerr << "Database schema version " << version << " is newer than this server supports (" << schemaVersion << ")" << std::endl;
+        return false;
+    }
+
+    for (int step = version; step < schemaVersion; step++) {
+        std::string sql = std::string("BEGIN IMMEDIATE; ") + migrations[step]
+            + " PRAGMA user_version = " + std::to_string(step + 1) + "; COMMIT;";
+        if (sqlite3_exec(db, sql.c_str(), 0, 0, 0) != SQLITE_OK) {
+            std::cerr << "Error applying schema migration " << step + 1 << ": " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+            return false;
+        }
+        std::cout << "Applied schema migration " << step + 1 << "." << std::endl;
+    }
+    return true;
+}
 
 int initializeDatabase(sqlite3*& db) {
-    const char* dbFileName = "pokemon_store.db";
-    int exit = sqlite3_open(dbFileName, &db);
+    int exit = sqlite3_open(DATABASE_FILE, &db);
     if (exit) {
         std::cerr << "Error opening database: " << sqlite3_errmsg(db) << std::endl;
         return exit;
     }
     std::cout << "Database opened successfully." << std::endl;
 
+    // WAL lets the reader connections run alongside the writer; FULL keeps
+    // every acknowledged commit durable
+    if (sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL;", 0, 0, 0) != SQLITE_OK) {
+        std::cerr << "Error enabling WAL mode: " << sqlite3_errmsg(db) << std::endl;
+    }
+
     const char* createUsersTableSQL =
         "CREATE TABLE IF NOT EXISTS Users ("
         "ID INTEGER PRIMARY KEY AUTOINCREMENT, "
@@ -53,323 +832,3597 @@ int initializeDatabase(sqlite3*& db) {
         std::cerr << "Error creating Pokemon_Cards table: " << sqlite3_errmsg(db) << std::endl;
     }
 
-    std::cout << "Tables created successfully." << std::endl;
-    return 0;
-}
+    std::cout << "Tables created successfully." << std::endl;
+
+    if (!migrateDatabase(db)) {
+        return SQLITE_ERROR;
+    }
+
+    // Nobody is connected yet, whatever an earlier run left behind
+    if (sqlite3_exec(db, "UPDATE Users SET logged_in = 0 WHERE logged_in <> 0", 0, 0, 0) != SQLITE_OK) {
+        std::cerr << "Error clearing logged-in users: " << sqlite3_errmsg(db) << std::endl;
+    }
+    return 0;
+}
+
+// Every SQL statement the command handlers run. Each sqlite connection
+// prepares all of them once and then only resets and rebinds them.
+enum StatementId {
+    STMT_BEGIN,
+    STMT_COMMIT,
+    STMT_ROLLBACK,
+    STMT_SAVEPOINT,
+    STMT_RELEASE,
+    STMT_ROLLBACK_TO,
+    STMT_LOGIN,
+    STMT_SET_LOGGED_IN,
+    STMT_CLEAR_LOGGED_IN,
+    STMT_SET_PASSWORD,
+    STMT_BALANCE,
+    STMT_CREDIT_BALANCE,
+    STMT_DEBIT_IF_FUNDED,
+    STMT_STOCK_COUNT,
+    STMT_TAKE_STOCK,
+    STMT_ADD_OWNED,
+    STMT_OWNED_COUNT,
+    STMT_TAKE_OWNED,
+    STMT_LOOKUP_CARD,
+    STMT_COUNT
+};
+
+const char* const statementSQL[STMT_COUNT] = {
+    "BEGIN IMMEDIATE",
+    "COMMIT",
+    "ROLLBACK",
+    "SAVEPOINT write",
+    "RELEASE write",
+    "ROLLBACK TO write",
+    "SELECT ID, is_root, password FROM Users WHERE username = ?",
+    "UPDATE Users SET logged_in = 1 WHERE ID = ?",
+    "UPDATE Users SET logged_in = 0 WHERE ID = ?",
+    "UPDATE Users SET password = ? WHERE ID = ?",
+    "SELECT usd_balance FROM Users WHERE ID = ?",
+    "UPDATE Users SET usd_balance = usd_balance + ? WHERE ID = ?",
+    "UPDATE Users SET usd_balance = usd_balance - ?1 WHERE ID = ?2 AND usd_balance >= ?1 RETURNING usd_balance",
+    "SELECT count FROM Pokemon_Cards WHERE card_name = ? AND owner_id IS NULL",
+    "UPDATE Pokemon_Cards SET count = count - ?1 WHERE ID = "
+        "(SELECT ID FROM Pokemon_Cards WHERE card_name = ?2 AND owner_id IS NULL AND count >= ?1 LIMIT 1) RETURNING ID, count",
+    "INSERT INTO Holdings (owner_id, card_id, count) VALUES (?1, ?2, ?3) "
+        "ON CONFLICT (owner_id, card_id) DO UPDATE SET count = count + excluded.count",
+    "SELECT h.count FROM Holdings h JOIN Pokemon_Cards c ON c.ID = h.card_id WHERE c.card_name = ? AND h.owner_id = ?",
+    "UPDATE Holdings SET count = count - ?1 WHERE owner_id = ?3 AND card_id = "
+        "(SELECT h.card_id FROM Holdings h JOIN Pokemon_Cards c ON c.ID = h.card_id "
+        "WHERE c.card_name = ?2 AND h.owner_id = ?3 AND h.count >= ?1 LIMIT 1) RETURNING count",
+    "SELECT card_name, card_type, rarity, count FROM Pokemon_Cards WHERE card_name = ? AND owner_id IS NULL ORDER BY ID LIMIT 1",
+};
+
+std::atomic<unsigned long long> statementCacheHits(0);
+
+// The prepared statements of one sqlite connection
+class StatementCache {
+public:
+    StatementCache() {
+        for (int i = 0; i < STMT_COUNT; i++) {
+            statements[i] = nullptr;
+        }
+    }
+
+    ~StatementCache() {
+        clear();
+    }
+
+    bool prepare(sqlite3* db) {
+        connection = db;
+        for (int i = 0; i < STMT_COUNT; i++) {
+            if (sqlite3_prepare_v3(db, statementSQL[i], -1, SQLITE_PREPARE_PERSISTENT, &statements[i], 0) != SQLITE_OK) {
+                std::cerr << "Error preparing statement \"" << statementSQL[i] << "\": " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Must run before the connection is closed
+    void clear() {
+        for (int i = 0; i < STMT_COUNT; i++) {
+            sqlite3_finalize(statements[i]);
+            statements[i] = nullptr;
+        }
+    }
+
+    sqlite3_stmt* get(StatementId id) {
+        statementCacheHits.fetch_add(1, std::memory_order_relaxed);
+        return statements[id];
+    }
+
+    sqlite3* database() const {
+        return connection;
+    }
+
+private:
+    StatementCache(const StatementCache&) = delete;
+    StatementCache& operator=(const StatementCache&) = delete;
+
+    sqlite3_stmt* statements[STMT_COUNT];
+    sqlite3* connection = nullptr;
+};
+
+// A statement borrowed from the cache for one command. It is reset and its
+// bindings cleared when it goes out of scope, or earlier through reset().
+class CachedStatement {
+public:
+    CachedStatement(StatementCache& cache, StatementId id) : stmt(cache.get(id)) {}
+
+    ~CachedStatement() {
+        reset();
+    }
+
+    void reset() {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+
+    operator sqlite3_stmt*() const {
+        return stmt;
+    }
+
+private:
+    CachedStatement(const CachedStatement&) = delete;
+    CachedStatement& operator=(const CachedStatement&) = delete;
+
+    sqlite3_stmt* stmt;
+};
+
+// A read-only connection with its own prepared statements, used by one
+// backend thread at a time. In WAL mode its reads see the last committed
+// state without waiting for the writer.
+struct Reader {
+    sqlite3* db = nullptr;
+    StatementCache statements;
+
+    ~Reader() {
+        statements.clear();
+        sqlite3_close(db);
+    }
+};
+
+class ReaderPool {
+public:
+    // Hands out an idle reader, opening a new one if there is none. Returns null on failure.
+    std::unique_ptr<Reader> acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!idle.empty()) {
+                std::unique_ptr<Reader> reader = std::move(idle.back());
+                idle.pop_back();
+                return reader;
+            }
+        }
+
+        std::unique_ptr<Reader> reader(new Reader());
+        if (sqlite3_open_v2(DATABASE_FILE, &reader->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+            std::cerr << "Error opening reader connection: " << sqlite3_errmsg(reader->db) << std::endl;
+            return nullptr;
+        }
+        sqlite3_busy_timeout(reader->db, 1000);
+        if (!reader->statements.prepare(reader->db)) {
+            return nullptr;
+        }
+        return reader;
+    }
+
+    void release(std::unique_ptr<Reader> reader) {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(std::move(reader));
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.clear();
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Reader>> idle;
+};
+
+ReaderPool readers;
+
+std::atomic<unsigned long long> listRenders(0);
+
+struct CatalogCard {
+    int id;
+    std::string name;
+    std::string type;
+    std::string rarity;
+    int count;
+};
+
+// The stock level of a catalog card after a committed write
+struct StockChange {
+    int cardId;
+    int count;
+};
+
+// Binary protocol, switched to with "HELLO BINARY". Every request is a
+// BinaryRequestHeader followed by length bytes of body, and every response a
+// BinaryReplyHeader followed by its body. Bodies are the fixed-layout structs
+// below; integers and doubles are little-endian and text fields are padded
+// with NULs. Responses come back in request order. The status is the code
+// the text protocol would have answered with (200, 400, 401, 404).
+//
+// Headers and bodies are copied to and from the wire as they lie in memory,
+// so the host has to be little-endian with IEEE 754 doubles. MSVC only
+// targets little-endian machines; elsewhere the compiler says which it is.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The binary protocol is sent in host byte order and needs a little-endian host"
+#endif
+static_assert(std::numeric_limits<double>::is_iec559, "BinaryDeposit and BinaryBalance carry IEEE 754 doubles");
+
+enum BinaryOpcode : uint16_t {
+    BIN_LOGIN = 1,   // BinaryLogin -> BinaryToken
+    BIN_BALANCE = 2, // no body -> BinaryBalance
+    BIN_DEPOSIT = 3, // BinaryDeposit -> no body
+    BIN_LOOKUP = 4,  // BinaryCardName -> BinaryCard
+    BIN_BUY = 5,     // BinaryTrade -> no body
+    BIN_SELL = 6,    // BinaryTrade -> no body
+    BIN_LIST = 7,    // BinaryListRequest -> BinaryListReply, then rows BinaryCards
+    BIN_RESUME = 8   // BinaryToken -> no body
+};
+
+struct BinaryRequestHeader {
+    uint32_t length; // of the body that follows
+    uint16_t opcode;
+    uint16_t reserved;
+};
+
+struct BinaryReplyHeader {
+    uint32_t length;
+    uint16_t opcode;
+    uint16_t status;
+};
+
+struct BinaryLogin {
+    char username[32];
+    char password[32];
+};
+
+struct BinaryToken {
+    char token[32]; // hex digits, as in the text protocol
+};
+
+struct BinaryDeposit {
+    double amount;
+};
+
+struct BinaryCardName {
+    char name[32];
+};
+
+struct BinaryTrade {
+    char name[32];
+    int32_t quantity;
+};
+
+struct BinaryListRequest {
+    uint32_t cursor; // nextCursor of the previous page; 0 for the first
+    uint32_t limit;  // 0 for the default page size
+    char type[16];   // filters, empty when not used
+    char rarity[16];
+    char prefix[32];
+};
+
+struct BinaryBalance {
+    double balance;
+};
+
+struct BinaryCard {
+    char name[32];
+    char type[16];
+    char rarity[16];
+    int32_t count;
+};
+
+struct BinaryListReply {
+    uint32_t rows;
+    uint32_t nextCursor; // 0 on the last page
+};
+
+static_assert(sizeof(BinaryRequestHeader) == 8 && sizeof(BinaryReplyHeader) == 8, "binary headers must stay 8 bytes");
+static_assert(sizeof(BinaryTrade) == 36 && sizeof(BinaryListRequest) == 72 && sizeof(BinaryCard) == 68, "binary structs must not change layout");
+
+// The text of a NUL-padded field
+template <size_t N>
+std::string_view fieldText(const char (&field)[N]) {
+    return std::string_view(field, std::find(field, field + N, '\0') - field);
+}
+
+// Fills a field with text, cut to fit and NUL-padded
+template <size_t N>
+void setField(char (&field)[N], std::string_view text) {
+    size_t length = std::min(text.size(), N);
+    memcpy(field, text.data(), length);
+    memset(field + length, 0, N - length);
+}
+
+void fillBinaryCard(BinaryCard& record, const CatalogCard& card) {
+    setField(record.name, card.name);
+    setField(record.type, card.type);
+    setField(record.rarity, card.rarity);
+    record.count = card.count;
+}
+
+// The store's cards (the Pokemon_Cards rows without an owner) held in memory,
+// so LIST and LOOKUP never touch SQLite. Loaded at startup; the writer thread
+// applies stock changes once the batch that made them has committed.
+class Catalog {
+public:
+    bool load(sqlite3* db) {
+        sqlite3_stmt* stmt;
+        const char* sql = "SELECT ID, card_name, card_type, rarity, count FROM Pokemon_Cards WHERE owner_id IS NULL ORDER BY ID";
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+            std::cerr << "Error loading catalog: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        cards.clear();
+        byName.clear();
+        byId.clear();
+        byType.clear();
+        byRarity.clear();
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            CatalogCard card;
+            card.id = sqlite3_column_int(stmt, 0);
+            card.name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+            card.type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+            card.rarity = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+            card.count = sqlite3_column_int(stmt, 4);
+            byId[card.id] = cards.size();
+            byType[card.type].push_back(cards.size());
+            byRarity[card.rarity].push_back(cards.size());
+            cards.push_back(card);
+        }
+        sqlite3_finalize(stmt);
+
+        // Keyed by views of the names, so only once cards stops growing
+        everything.resize(cards.size());
+        for (size_t i = 0; i < cards.size(); i++) {
+            byName.emplace(cards[i].name, i); // LOOKUP shows the first card of a name
+            everything[i] = i;
+        }
+        nameOrder = everything;
+        std::sort(nameOrder.begin(), nameOrder.end(), [this](size_t a, size_t b) {
+            return nameKeyLess(cards[a], cards[b].name, cards[b].id);
+        });
+        version++;
+        return true;
+    }
+
+    // The full LIST reply. It is rendered at most once per catalog version and
+    // then shared by every connection that sends it.
+    OutputQueue::SharedBuffer list() {
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(mutex);
+            if (listingVersion == version) {
+                return listing;
+            }
+        }
+
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        if (listingVersion != version) {
+            std::string response;
+            response.reserve(listing ? listing->size() : 0);
+            response += CARDS_HEADER;
+            int last;
+            bool finished;
+            renderRows(ListQuery(), 0, (size_t)-1, (size_t)-1, response, textRow<std::string>, last, finished);
+            listing = std::make_shared<const std::string>(std::move(response));
+            listingVersion = version;
+            listRenders++;
+        }
+        return listing;
+    }
+
+    // Writes one page of a filtered LIST, resuming after the card the cursor names
+    void listPage(const ListQuery& query, OutputQueue& out) const {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        ReplyWriter<OutputQueue> reply(out);
+
+        int after = 0;
+        if (!query.cursor.empty() && !decodeCursor(query.cursor, after)) {
+            reply << "400 Invalid cursor\n";
+            return;
+        }
+
+        reply << CARDS_HEADER;
+        int last = 0;
+        bool finished;
+        if (renderRows(query, after, query.limit, (size_t)-1, out, textRow<OutputQueue>, last, finished) == query.limit) {
+            char cursor[16];
+            reply << "Next cursor: " << encodeCursor(last, cursor) << "\n";
+        }
+        else {
+            reply << "Next cursor: none\n";
+        }
+    }
+
+    // Renders the next slice of a streamed LIST, stopping once about maxBytes
+    // have been written, and moves the stream past it. The catalog is only
+    // locked per slice. Returns true once the END line has been written.
+    bool streamSlice(ListStream& stream, size_t maxBytes, OutputQueue& out) const {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        ReplyWriter<OutputQueue> reply(out);
+        if (!stream.started) {
+            stream.started = true;
+            if (!stream.query.cursor.empty() && !decodeCursor(stream.query.cursor, stream.after)) {
+                reply << "400 Invalid cursor\n";
+                return true;
+            }
+            reply << CARDS_HEADER;
+        }
+
+        bool finished;
+        renderRows(stream.query, stream.after, (size_t)-1, maxBytes, out, textRow<OutputQueue>, stream.after, finished);
+        if (finished) {
+            reply << "END\n";
+        }
+        return finished;
+    }
+
+    unsigned long long currentVersion() const {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return version;
+    }
+
+    // Writes the LOOKUP reply for the first card called name
+    bool describe(std::string_view name, OutputQueue& out) const {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        auto it = byName.find(name);
+        if (it == byName.end()) {
+            return false;
+        }
+        const CatalogCard& card = cards[it->second];
+        ReplyWriter<OutputQueue>(out) << CARD_DETAILS_HEADER
+            << "Name: " << card.name << "\n"
+            << "Type: " << card.type << "\n"
+            << "Rarity: " << card.rarity << "\n"
+            << "Count: " << card.count << "\n";
+        return true;
+    }
+
+    bool describe(std::string_view name, BinaryCard& record) const {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        auto it = byName.find(name);
+        if (it == byName.end()) {
+            return false;
+        }
+        fillBinaryCard(record, cards[it->second]);
+        return true;
+    }
+
+    // A page of a filtered LIST for the binary protocol: the rows appended to
+    // records as BinaryCards, their number and the cursor of the next page, 0 when there is
+    // none. Returns false for a cursor that names no card.
+    bool listRecords(const ListQuery& query, std::string& records, size_t& rows, uint32_t& nextCursor) const {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        int after = 0;
+        if (!query.cursor.empty() && !decodeCursor(query.cursor, after)) {
+            return false;
+        }
+        int last = 0;
+        bool finished;
+        rows = renderRows(query, after, query.limit, (size_t)-1, records, binaryRow, last, finished);
+        nextCursor = rows == query.limit ? (unsigned)last ^ CURSOR_MASK : 0;
+        return true;
+    }
+
+    void apply(const std::vector<StockChange>& changes) {
+        if (changes.empty()) {
+            return;
+        }
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        for (const StockChange& change : changes) {
+            auto it = byId.find(change.cardId);
+            if (it != byId.end()) {
+                cards[it->second].count = change.count;
+            }
+        }
+        version++;
+    }
+
+private:
+    typedef std::unordered_map<std::string, std::vector<size_t>> SecondaryIndex;
+
+    // Appends the rows matching query that come after the card with ID after,
+    // each through writeRow, until maxRows rows or about maxBytes have been written. Rows are in ID
+    // order, read from the type or rarity index when one of those filters is
+    // given; a name prefix switches to name order so only the matching range
+    // of the name index is walked. Either way the resume point is found with
+    // a binary search. Sets last to the last card written and finished when
+    // nothing matching is left. Returns the number of rows written.
+    template <typename Output, typename WriteRow>
+    size_t renderRows(const ListQuery& query, int after, size_t maxRows, size_t maxBytes, Output& out, WriteRow writeRow, int& last, bool& finished) const {
+        const std::vector<size_t>* index;
+        std::vector<size_t>::const_iterator position;
+        if (!query.prefix.empty()) {
+            index = &nameOrder;
+            if (after == 0) {
+                position = std::lower_bound(index->begin(), index->end(), query.prefix, [this](size_t i, const std::string& prefix) {
+                    return cards[i].name < prefix;
+                });
+            }
+            else {
+                const CatalogCard& previous = cards[byId.at(after)];
+                position = std::upper_bound(index->begin(), index->end(), previous, [this](const CatalogCard& key, size_t i) {
+                    return nameKeyLess(key, cards[i].name, cards[i].id);
+                });
+            }
+        }
+        else {
+            index = &everything;
+            if (!query.type.empty()) {
+                index = findIndex(byType, query.type);
+            }
+            else if (!query.rarity.empty()) {
+                index = findIndex(byRarity, query.rarity);
+            }
+            position = std::upper_bound(index->begin(), index->end(), after, [this](int id, size_t i) {
+                return id < cards[i].id;
+            });
+        }
+
+        size_t rows = 0;
+        size_t startSize = out.size();
+        finished = false;
+        while (rows < maxRows && out.size() - startSize < maxBytes) {
+            if (position == index->end()) {
+                finished = true;
+                break;
+            }
+            const CatalogCard& card = cards[*position++];
+            if (!query.prefix.empty() && card.name.compare(0, query.prefix.size(), query.prefix) != 0) {
+                finished = true; // past the end of the prefix range
+                break;
+            }
+            if ((!query.type.empty() && card.type != query.type) || (!query.rarity.empty() && card.rarity != query.rarity)) {
+                continue;
+            }
+            writeRow(out, card);
+            last = card.id;
+            rows++;
+        }
+        return rows;
+    }
+
+    template <typename Output>
+    static void textRow(Output& out, const CatalogCard& card) {
+        ReplyWriter<Output>(out) << card.name << " | Type: " << card.type << " | Rarity: " << card.rarity << " | Count: " << card.count << "\n";
+    }
+
+    static void binaryRow(std::string& out, const CatalogCard& card) {
+        BinaryCard record;
+        fillBinaryCard(record, card);
+        out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+
+    static bool nameKeyLess(const CatalogCard& card, const std::string& name, int id) {
+        int order = card.name.compare(name);
+        return order < 0 || (order == 0 && card.id < id);
+    }
+
+    const std::vector<size_t>* findIndex(const SecondaryIndex& secondary, const std::string& key) const {
+        static const std::vector<size_t> none;
+        auto it = secondary.find(key);
+        return it != secondary.end() ? &it->second : &none;
+    }
+
+    // Cursors are only meant to be handed back, so they are kept opaque
+    static std::string_view encodeCursor(int id, char (&text)[16]) {
+        std::to_chars_result result = std::to_chars(text, text + sizeof(text), (unsigned)id ^ CURSOR_MASK, 16);
+        return std::string_view(text, result.ptr - text);
+    }
+
+    bool decodeCursor(const std::string& cursor, int& id) const {
+        char* end;
+        unsigned long value = strtoul(cursor.c_str(), &end, 16);
+        if (*end != '\0') {
+            return false;
+        }
+        id = (int)((unsigned)value ^ CURSOR_MASK);
+        return byId.count(id) != 0;
+    }
+
+    static const unsigned CURSOR_MASK = 0x5bd1e995;
+
+    mutable std::shared_timed_mutex mutex;
+    unsigned long long version = 0; // bumped by every change
+    OutputQueue::SharedBuffer listing;
+    unsigned long long listingVersion = 0; // catalog version the listing was rendered from
+    std::vector<CatalogCard> cards; // in ID order, as LIST shows them
+    std::unordered_map<std::string_view, size_t> byName;
+    std::unordered_map<int, size_t> byId;
+    // Positions in cards: all of them, per type and per rarity (each in ID order), and sorted by name
+    std::vector<size_t> everything;
+    SecondaryIndex byType;
+    SecondaryIndex byRarity;
+    std::vector<size_t> nameOrder;
+};
+
+Catalog catalog;
+
+bool execStatement(StatementCache& statements, StatementId id) {
+    CachedStatement stmt(statements, id);
+    return sqlite3_step(stmt) == SQLITE_DONE;
+}
+
+// Keeps the changes of one write, or undoes them, leaving the rest of the
+// writer's batch alone. Returns whether the changes were kept.
+bool closeSavepoint(StatementCache& statements, bool keep) {
+    if (keep && execStatement(statements, STMT_RELEASE)) {
+        return true;
+    }
+    execStatement(statements, STMT_ROLLBACK_TO);
+    execStatement(statements, STMT_RELEASE);
+    return false;
+}
+
+// Works out why a conditional stock update matched no row
+std::string_view stockFailure(StatementCache& statements, const std::string& cardName) {
+    CachedStatement stmt(statements, STMT_STOCK_COUNT);
+    sqlite3_bind_text(stmt, 1, cardName.c_str(), -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        return "400 Not enough stock\n";
+    }
+    return "404 Card not found\n";
+}
+
+std::string_view balanceFailure(StatementCache& statements, int userId) {
+    CachedStatement stmt(statements, STMT_BALANCE);
+    sqlite3_bind_int(stmt, 1, userId);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        return "400 Insufficient funds\n";
+    }
+    return "400 Database error\n";
+}
+
+// Moves cards from the store's stock to the user and charges for them, as one
+// all-or-nothing unit. The updates only match when there is enough stock and
+// balance, so nothing has to be read first. The new stock level is added to
+// stockChanges for the catalog.
+std::string_view buyCards(StatementCache& statements, std::vector<StockChange>& stockChanges, int userId, const std::string& cardName, int quantity) {
+    if (quantity <= 0) {
+        return "400 Invalid quantity\n";
+    }
+    double totalCost = quantity * PRICE_PER_CARD;
+
+    if (!execStatement(statements, STMT_SAVEPOINT)) {
+        return "400 Database error\n";
+    }
+    std::string_view failure;
+
+    CachedStatement takeStock(statements, STMT_TAKE_STOCK);
+    sqlite3_bind_int(takeStock, 1, quantity);
+    sqlite3_bind_text(takeStock, 2, cardName.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(takeStock);
+    int cardId = rc == SQLITE_ROW ? sqlite3_column_int(takeStock, 0) : 0;
+    int stockLeft = rc == SQLITE_ROW ? sqlite3_column_int(takeStock, 1) : 0;
+    takeStock.reset();
+    if (rc != SQLITE_ROW) {
+        failure = rc == SQLITE_DONE ? stockFailure(statements, cardName) : std::string_view("400 Database error\n");
+    }
+
+    if (failure.empty()) {
+        CachedStatement debit(statements, STMT_DEBIT_IF_FUNDED);
+        sqlite3_bind_double(debit, 1, totalCost);
+        sqlite3_bind_int(debit, 2, userId);
+        rc = sqlite3_step(debit);
+        debit.reset();
+        if (rc != SQLITE_ROW) {
+            failure = rc == SQLITE_DONE ? balanceFailure(statements, userId) : std::string_view("400 Database error\n");
+        }
+    }
+
+    if (failure.empty()) {
+        // Add the purchased cards to the user's holding of that card
+        CachedStatement assignOwnership(statements, STMT_ADD_OWNED);
+        sqlite3_bind_int(assignOwnership, 1, userId);
+        sqlite3_bind_int(assignOwnership, 2, cardId);
+        sqlite3_bind_int(assignOwnership, 3, quantity);
+        if (sqlite3_step(assignOwnership) != SQLITE_DONE) {
+            failure = "400 Database error\n";
+        }
+    }
+
+    if (!closeSavepoint(statements, failure.empty())) {
+        return failure.empty() ? "400 Database error\n" : failure;
+    }
+    stockChanges.push_back(StockChange{ cardId, stockLeft });
+    return "200 OK - Purchase successful\n";
+}
+
+// Takes cards from the user's holding and credits the sale, as one all-or-nothing unit
+std::string_view sellCards(StatementCache& statements, int userId, const std::string& cardName, int quantity) {
+    if (quantity <= 0) {
+        return "400 Invalid quantity\n";
+    }
+    double totalEarnings = quantity * PRICE_PER_CARD;
+
+    if (!execStatement(statements, STMT_SAVEPOINT)) {
+        return "400 Database error\n";
+    }
+    std::string_view failure;
+
+    CachedStatement takeOwned(statements, STMT_TAKE_OWNED);
+    sqlite3_bind_int(takeOwned, 1, quantity);
+    sqlite3_bind_text(takeOwned, 2, cardName.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(takeOwned, 3, userId);
+    int rc = sqlite3_step(takeOwned);
+    takeOwned.reset();
+    if (rc == SQLITE_DONE) {
+        CachedStatement owned(statements, STMT_OWNED_COUNT);
+        sqlite3_bind_text(owned, 1, cardName.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int(owned, 2, userId);
+        if (sqlite3_step(owned) == SQLITE_ROW) {
+            failure = "400 Not enough stock to sell\n";
+        }
+        else {
+            failure = "404 Not Found - Card not owned by user\n";
+        }
+    }
+    else if (rc != SQLITE_ROW) {
+        failure = "400 Database error\n";
+    }
+
+    if (failure.empty()) {
+        CachedStatement credit(statements, STMT_CREDIT_BALANCE);
+        sqlite3_bind_double(credit, 1, totalEarnings);
+        sqlite3_bind_int(credit, 2, userId);
+        if (sqlite3_step(credit) != SQLITE_DONE || sqlite3_changes(sqlite3_db_handle(credit)) != 1) {
+            failure = "400 Database error\n";
+        }
+    }
+
+    if (!closeSavepoint(statements, failure.empty())) {
+        return failure.empty() ? "400 Database error\n" : failure;
+    }
+    return "200 OK - Sell successful\n";
+}
+
+enum WriteKind {
+    WRITE_LOGIN,  // presence persisted for request.userId; nobody waits for the reply
+    WRITE_LOGOUT,
+    WRITE_PASSWORD, // a password rehashed at login; nobody waits for this one either
+    WRITE_DEPOSIT,
+    WRITE_BUY,
+    WRITE_SELL,
+    WRITE_CHECKOUT, // the cards in batch, bought all or none
+    WRITE_BATCH,   // the commands in batch, in order
+    WRITE_BALANCE, // reads, only inside a batch, so they see its earlier writes
+    WRITE_LOOKUP,
+    WRITE_REJECTED // a command BATCH does not take
+};
+
+// A mutating command queued for the writer thread
+struct WriteRequest {
+    explicit WriteRequest(WriteKind kind) : kind(kind) {}
+
+    WriteKind kind;
+    Connection* conn = nullptr;
+    int userId = -1;
+    std::string name; // username or card name
+    std::string password;
+    double amount = 0;
+    int quantity = 0;
+    std::vector<WriteRequest> batch; // for WRITE_BATCH, and the cart of a WRITE_CHECKOUT as WRITE_BUYs
+};
+
+// Buys every card in the cart as one all-or-nothing unit: each card's stock
+// is taken in turn and the whole cost is then charged at once. The first card
+// that cannot be had, or a balance short of the total, rolls everything back
+// and is named in the reply.
+WriteResult checkoutCart(StatementCache& statements, std::vector<StockChange>& stockChanges, const WriteRequest& request) {
+    WriteResult result("400 Database error\n");
+    if (!execStatement(statements, STMT_SAVEPOINT)) {
+        return result;
+    }
+    std::string_view failure;
+    const std::string* failedCard = nullptr;
+    size_t changesBefore = stockChanges.size();
+    double totalCost = 0;
+
+    for (const WriteRequest& item : request.batch) {
+        CachedStatement takeStock(statements, STMT_TAKE_STOCK);
+        sqlite3_bind_int(takeStock, 1, item.quantity);
+        sqlite3_bind_text(takeStock, 2, item.name.c_str(), -1, SQLITE_STATIC);
+        int rc = sqlite3_step(takeStock);
+        if (rc != SQLITE_ROW) {
+            takeStock.reset();
+            failure = rc == SQLITE_DONE ? stockFailure(statements, item.name) : std::string_view("400 Database error\n");
+            failedCard = &item.name;
+            break;
+        }
+        int cardId = sqlite3_column_int(takeStock, 0);
+        stockChanges.push_back(StockChange{ cardId, sqlite3_column_int(takeStock, 1) });
+        takeStock.reset();
+
+        CachedStatement assignOwnership(statements, STMT_ADD_OWNED);
+        sqlite3_bind_int(assignOwnership, 1, request.userId);
+        sqlite3_bind_int(assignOwnership, 2, cardId);
+        sqlite3_bind_int(assignOwnership, 3, item.quantity);
+        if (sqlite3_step(assignOwnership) != SQLITE_DONE) {
+            failure = "400 Database error\n";
+            break;
+        }
+        totalCost += item.quantity * PRICE_PER_CARD;
+    }
+
+    if (failure.empty()) {
+        CachedStatement debit(statements, STMT_DEBIT_IF_FUNDED);
+        sqlite3_bind_double(debit, 1, totalCost);
+        sqlite3_bind_int(debit, 2, request.userId);
+        int rc = sqlite3_step(debit);
+        debit.reset();
+        if (rc != SQLITE_ROW) {
+            failure = rc == SQLITE_DONE ? balanceFailure(statements, request.userId) : std::string_view("400 Database error\n");
+        }
+    }
+
+    if (!closeSavepoint(statements, failure.empty())) {
+        stockChanges.resize(changesBefore);
+        if (failure.empty() || failedCard == nullptr) {
+            result.reply = failure.empty() ? "400 Database error\n" : failure;
+        }
+        else {
+            // "400 Not enough stock: Charizard"
+            ReplyWriter<std::string>(result.replies) << failure.substr(0, failure.size() - 1) << ": " << *failedCard << "\n";
+        }
+        return result;
+    }
+    result.reply = "200 OK - Checkout successful\n";
+    return result;
+}
+
+WriteResult applyWrite(StatementCache& statements, std::vector<StockChange>& stockChanges, const WriteRequest& request);
+
+// Runs the commands of a BATCH block in order inside the writer's
+// transaction and collects their replies, ending with an END line. Each
+// write keeps its own savepoint, so one failing does not undo the others.
+WriteResult applyBatch(StatementCache& statements, std::vector<StockChange>& stockChanges, const WriteRequest& request) {
+    WriteResult result{ "" };
+    ReplyWriter<std::string> reply(result.replies);
+    reply << "200 OK - Batch results:\n";
+    for (const WriteRequest& command : request.batch) {
+        switch (command.kind) {
+        case WRITE_BALANCE: {
+            CachedStatement stmt(statements, STMT_BALANCE);
+            sqlite3_bind_int(stmt, 1, request.userId);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                reply << BALANCE_PREFIX << sqlite3_column_double(stmt, 0) << "\n";
+            }
+            else {
+                reply << "401 Unauthorized - Not logged in\n";
+            }
+            break;
+        }
+        case WRITE_LOOKUP: {
+            CachedStatement stmt(statements, STMT_LOOKUP_CARD);
+            sqlite3_bind_text(stmt, 1, command.name.c_str(), -1, SQLITE_STATIC);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                reply << CARD_DETAILS_HEADER
+                    << "Name: " << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)) << "\n"
+                    << "Type: " << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)) << "\n"
+                    << "Rarity: " << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)) << "\n"
+                    << "Count: " << sqlite3_column_int(stmt, 3) << "\n";
+            }
+            else {
+                reply << "404 Not Found - Card not found\n";
+            }
+            break;
+        }
+        case WRITE_DEPOSIT:
+        case WRITE_BUY:
+        case WRITE_SELL: {
+            if (command.kind == WRITE_DEPOSIT && !std::isfinite(command.amount)) {
+                reply << "400 Invalid amount\n";
+                break;
+            }
+            WriteRequest step(command.kind);
+            step.userId = request.userId;
+            step.name = command.name;
+            step.amount = command.amount;
+            step.quantity = command.quantity;
+            reply << applyWrite(statements, stockChanges, step).reply;
+            break;
+        }
+        default:
+            reply << "400 Command not allowed in BATCH\n";
+            break;
+        }
+        // SQLITE_FULL, IOERR or NOMEM can roll back the writer's whole
+        // transaction; the rest of the block would then commit on its own
+        if (sqlite3_get_autocommit(statements.database())) {
+            return WriteResult{ "400 Database error\n" };
+        }
+    }
+    reply << "END\n";
+    return result;
+}
+
+WriteResult applyWrite(StatementCache& statements, std::vector<StockChange>& stockChanges, const WriteRequest& request) {
+    switch (request.kind) {
+    case WRITE_LOGIN:
+    case WRITE_LOGOUT: {
+        CachedStatement stmt(statements, request.kind == WRITE_LOGIN ? STMT_SET_LOGGED_IN : STMT_CLEAR_LOGGED_IN);
+        sqlite3_bind_int(stmt, 1, request.userId);
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            return WriteResult{ "200 OK\n" };
+        }
+        break;
+    }
+    case WRITE_PASSWORD: {
+        CachedStatement stmt(statements, STMT_SET_PASSWORD);
+        sqlite3_bind_text(stmt, 1, request.password.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, request.userId);
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            return WriteResult{ "200 OK\n" };
+        }
+        break;
+    }
+    case WRITE_DEPOSIT: {
+        CachedStatement stmt(statements, STMT_CREDIT_BALANCE);
+        sqlite3_bind_double(stmt, 1, request.amount);
+        sqlite3_bind_int(stmt, 2, request.userId);
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            return WriteResult{ "200 OK - Deposit successful\n" };
+        }
+        break;
+    }
+    case WRITE_BUY:
+        return WriteResult{ buyCards(statements, stockChanges, request.userId, request.name, request.quantity) };
+    case WRITE_SELL:
+        return WriteResult{ sellCards(statements, request.userId, request.name, request.quantity) };
+    case WRITE_CHECKOUT:
+        return checkoutCart(statements, stockChanges, request);
+    case WRITE_BATCH:
+        return applyBatch(statements, stockChanges, request);
+    default:
+        break;
+    }
+    return WriteResult{ "400 Database error\n" };
+}
+
+std::atomic<unsigned long long> groupCommits(0);
+std::atomic<unsigned long long> groupCommitWrites(0);
+
+// Group commit: connection threads queue their mutations here and one writer
+// thread applies everything queued in a single transaction, so a whole batch
+// shares one sync to disk. Each write sits in its own savepoint, so a failed
+// command only undoes itself. Results are posted back to the connection only
+// after the batch has committed.
+class GroupCommitWriter {
+public:
+    void start(sqlite3* connection, StatementCache& cache, unsigned batchSize, unsigned batchDelayMicros) {
+        db = connection;
+        statements = &cache;
+        maxBatch = batchSize > 0 ? batchSize : 1;
+        maxDelay = std::chrono::microseconds(batchDelayMicros);
+        running = true;
+        thread = std::thread(&GroupCommitWriter::run, this);
+    }
+
+    // Commits whatever is still queued, then stops the thread
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        queued.notify_one();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    void submit(WriteRequest&& request) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (running) {
+                queue.push_back(std::move(request));
+                queued.notify_one();
+                return;
+            }
+        }
+        if (request.conn != nullptr) {
+            request.conn->completions->post(request.conn, WriteResult{ "400 Database error\n" });
+        }
+    }
+
+private:
+    void run() {
+        std::vector<WriteRequest> batch;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            queued.wait(lock, [this] { return !running || !queue.empty(); });
+            if (queue.empty()) {
+                break;
+            }
+            if (maxDelay.count() > 0 && queue.size() < maxBatch && running) {
+                queued.wait_for(lock, maxDelay, [this] { return !running || queue.size() >= maxBatch; });
+            }
+            while (!queue.empty() && batch.size() < maxBatch) {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            lock.unlock();
+            commitBatch(batch);
+            batch.clear();
+            lock.lock();
+        }
+    }
+
+    void commitBatch(std::vector<WriteRequest>& batch) {
+        std::vector<WriteResult> results;
+        std::vector<StockChange> stockChanges;
+        results.reserve(batch.size());
+        {
+            std::lock_guard<std::mutex> lock(db_mutex);
+            bool open = execStatement(*statements, STMT_BEGIN);
+            for (size_t i = 0; open && i < batch.size(); i++) {
+                results.push_back(applyWrite(*statements, stockChanges, batch[i]));
+                // SQLITE_FULL, IOERR or NOMEM can roll back the whole transaction,
+                // not just the savepoint; the rest must not run outside of it
+                open = !sqlite3_get_autocommit(db);
+            }
+            if (!open || !execStatement(*statements, STMT_COMMIT)) {
+                execStatement(*statements, STMT_ROLLBACK);
+                results.assign(batch.size(), WriteResult{ "400 Database error\n" });
+                stockChanges.clear();
+            }
+        }
+        catalog.apply(stockChanges);
+        groupCommits++;
+        groupCommitWrites += batch.size();
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (batch[i].conn != nullptr) {
+                batch[i].conn->completions->post(batch[i].conn, std::move(results[i]));
+            }
+        }
+    }
+
+    sqlite3* db = nullptr;
+    StatementCache* statements = nullptr;
+    unsigned maxBatch = WRITE_BATCH_SIZE;
+    std::chrono::microseconds maxDelay;
+    bool running = false;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::deque<WriteRequest> queue;
+    std::thread thread;
+};
+
+GroupCommitWriter writer;
+
+// Hands a mutation to the writer; the connection runs nothing else until the reply is back
+void submitWrite(Connection& conn, WriteRequest& request) {
+    request.conn = &conn;
+    request.userId = conn.session->userId;
+    conn.awaitingWrite = true;
+    writer.submit(std::move(request));
+}
+
+// Who is logged in, kept in memory: LOGIN adds the user, LOGOUT or closing
+// the connection takes them out again, and WHO lists the set under a shared
+// lock. A user logged in on several connections is listed once, until the
+// last of them is gone. With persistence on, each change is also handed to
+// the writer for Users.logged_in, without anyone waiting for the commit.
+class PresenceRegistry {
+public:
+    void setPersistent(bool enabled) {
+        persistent = enabled;
+    }
+
+    void enter(int userId, std::string_view username) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        Presence& presence = users[userId];
+        if (presence.sessions++ == 0) {
+            presence.username = username;
+            persist(WRITE_LOGIN, userId);
+        }
+    }
+
+    void leave(int userId) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::map<int, Presence>::iterator found = users.find(userId);
+        if (found != users.end() && --found->second.sessions == 0) {
+            users.erase(found);
+            persist(WRITE_LOGOUT, userId);
+        }
+    }
+
+    void list(ReplyWriter<OutputQueue>& reply) {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for (const std::pair<const int, Presence>& user : users) {
+            reply << user.second.username << "\n";
+        }
+    }
+
+    unsigned long long size() {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return users.size();
+    }
+
+private:
+    struct Presence {
+        std::string username;
+        unsigned sessions = 0; // connections logged in as the user
+    };
+
+    // Submitted under the lock, so the writer sees the changes in order
+    void persist(WriteKind kind, int userId) {
+        if (persistent) {
+            WriteRequest request(kind);
+            request.userId = userId;
+            writer.submit(std::move(request));
+        }
+    }
+
+    std::shared_mutex mutex;
+    std::map<int, Presence> users; // by ID, the order WHO used to read them from Users
+    bool persistent = false;
+};
+
+PresenceRegistry presence;
+
+// A client's token buckets, one per class. Tokens refill at the class's rate
+// up to its burst, and each admitted command takes one.
+struct RateBuckets {
+    std::mutex mutex;
+    double tokens[RATE_CLASSES];
+    std::chrono::steady_clock::time_point refilled;
+};
+
+std::atomic<unsigned long long> rateLimited[RATE_CLASSES];
+
+// Token buckets per client address and per logged-in user, checked before a
+// command runs. A connection holds on to its buckets, so the check is one
+// small lock and no lookup. Buckets outlive their connections, or
+// reconnecting would refill them; once the table grows past its sweep size,
+// the ones nobody holds that have filled up again are dropped.
+class RateLimiter {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    void configure(const RateLimit (&classLimits)[RATE_CLASSES]) {
+        for (int i = 0; i < RATE_CLASSES; i++) {
+            limits[i] = classLimits[i];
+        }
+    }
+
+    // Gives a new connection the buckets of the address it comes from
+    void attach(Connection& conn) {
+        sockaddr_in address;
+        socklen_t length = sizeof(address);
+        if (getpeername(conn.socket, (struct sockaddr*)&address, &length) == 0 && address.sin_family == AF_INET) {
+            conn.addressLimits = find(addresses, address.sin_addr.s_addr);
+        }
+    }
+
+    std::shared_ptr<RateBuckets> forUser(int userId) {
+        return find(users, (uint32_t)userId);
+    }
+
+    // Takes a token for the class from the connection's address and user; false when either has none left
+    bool admit(Connection& conn, RateClass rateClass) {
+        if (rateClass == RATE_EXEMPT || limits[rateClass].perSecond <= 0) {
+            return true;
+        }
+        RateBuckets* address = conn.addressLimits.get();
+        RateBuckets* user = conn.session->userLimits.get();
+        Clock::time_point now = Clock::now();
+        bool admitted = true;
+        if (address != nullptr && user != nullptr) {
+            std::scoped_lock lock(address->mutex, user->mutex);
+            admitted = take(*address, *user, rateClass, now);
+        }
+        else if (address != nullptr || user != nullptr) {
+            RateBuckets& buckets = address != nullptr ? *address : *user;
+            std::lock_guard<std::mutex> lock(buckets.mutex);
+            admitted = take(buckets, buckets, rateClass, now);
+        }
+        if (!admitted) {
+            rateLimited[rateClass]++;
+        }
+        return admitted;
+    }
+
+private:
+    typedef std::unordered_map<uint32_t, std::shared_ptr<RateBuckets>> BucketTable;
+
+    std::shared_ptr<RateBuckets> find(BucketTable& table, uint32_t key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<RateBuckets>& buckets = table[key];
+        if (!buckets) {
+            if (table.size() > sweepAt) {
+                sweep(table);
+            }
+            buckets = std::make_shared<RateBuckets>();
+            for (int i = 0; i < RATE_CLASSES; i++) {
+                buckets->tokens[i] = limits[i].burst;
+            }
+            buckets->refilled = Clock::now();
+        }
+        return buckets;
+    }
+
+    void sweep(BucketTable& table) {
+        Clock::time_point now = Clock::now();
+        for (BucketTable::iterator it = table.begin(); it != table.end();) {
+            if (it->second && it->second.use_count() == 1 && full(*it->second, now)) {
+                it = table.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        sweepAt = std::max<size_t>(RATE_TABLE_SWEEP, 2 * table.size());
+    }
+
+    bool full(RateBuckets& buckets, Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(buckets.mutex);
+        refill(buckets, now);
+        for (int i = 0; i < RATE_CLASSES; i++) {
+            if (buckets.tokens[i] < limits[i].burst) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void refill(RateBuckets& buckets, Clock::time_point now) {
+        double seconds = std::chrono::duration<double>(now - buckets.refilled).count();
+        if (seconds <= 0) {
+            return;
+        }
+        for (int i = 0; i < RATE_CLASSES; i++) {
+            buckets.tokens[i] = std::min(limits[i].burst, buckets.tokens[i] + seconds * limits[i].perSecond);
+        }
+        buckets.refilled = now;
+    }
+
+    // Both buckets must have a token before either gives one up
+    bool take(RateBuckets& first, RateBuckets& second, RateClass rateClass, Clock::time_point now) {
+        refill(first, now);
+        refill(second, now);
+        if (first.tokens[rateClass] < 1 || second.tokens[rateClass] < 1) {
+            return false;
+        }
+        first.tokens[rateClass]--;
+        if (&second != &first) {
+            second.tokens[rateClass]--;
+        }
+        return true;
+    }
+
+    RateLimit limits[RATE_CLASSES] = {};
+    std::mutex mutex;
+    BucketTable addresses;
+    BucketTable users;
+    size_t sweepAt = RATE_TABLE_SWEEP;
+};
+
+RateLimiter rateLimiter;
+
+void logIn(Session& session, int userId, bool root, std::string_view username) {
+    logOut(session);
+    session.userId = userId;
+    session.root = root;
+    session.username = username;
+    session.userLimits = rateLimiter.forUser(userId);
+    presence.enter(userId, username);
+}
+
+void logOut(Session& session) {
+    if (session.userId >= 0) {
+        presence.leave(session.userId);
+        session.userId = -1;
+        session.root = false;
+        session.username.clear();
+        session.token = SessionToken();
+        session.userLimits.reset();
+    }
+}
+
+// Tokens LOGIN hands out so a client that reconnects can RESUME its session
+// without the Users table being asked again. A token lives until LOGOUT or
+// until it goes unused for the lifetime; every RESUME starts the lifetime
+// over. Expired tokens are dropped from the front of a queue of the deadlines
+// they were issued with. A token RESUMEd since then goes back in at its new
+// deadline when it comes up, so the queue holds one entry per token however
+// often it is resumed.
+class SessionTokens {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    void setLifetime(unsigned seconds) {
+        lifetime = std::chrono::seconds(seconds);
+    }
+
+    // Gives the session's user a new token, kept in session.token
+    void issue(Session& session) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Clock::time_point now = Clock::now();
+        expire(now);
+        SessionToken token;
+        do {
+            token.high = ((uint64_t)random() << 32) | random();
+            token.low = ((uint64_t)random() << 32) | random();
+        } while (token.empty() || table.count(token) != 0);
+        table.emplace(token, Resumable{ session.userId, session.root, session.username, now + lifetime });
+        expiries.emplace_back(now + lifetime, token);
+        session.token = token;
+    }
+
+    // Logs the session in as the token's user; false when the token is unknown or has run out
+    bool resume(const SessionToken& token, Session& session) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Clock::time_point now = Clock::now();
+        expire(now);
+        std::unordered_map<SessionToken, Resumable, SessionTokenHash>::iterator found = table.find(token);
+        // A re-queued deadline can sit behind a later one, so the queue may not have caught up yet
+        if (found == table.end() || found->second.expires <= now) {
+            return false;
+        }
+        Resumable& resumable = found->second;
+        resumable.expires = now + lifetime;
+        // The token this session held before is replaced, as on LOGOUT
+        if (!session.token.empty() && !(session.token == token)) {
+            table.erase(session.token);
+        }
+        logIn(session, resumable.userId, resumable.root, resumable.username);
+        session.token = token;
+        return true;
+    }
+
+    void revoke(const SessionToken& token) {
+        std::lock_guard<std::mutex> lock(mutex);
+        table.erase(token);
+    }
+
+    unsigned long long size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return table.size();
+    }
+
+private:
+    struct Resumable {
+        int userId;
+        bool root;
+        std::string username;
+        Clock::time_point expires;
+    };
+
+    void expire(Clock::time_point now) {
+        while (!expiries.empty() && expiries.front().first <= now) {
+            std::unordered_map<SessionToken, Resumable, SessionTokenHash>::iterator found = table.find(expiries.front().second);
+            if (found != table.end()) {
+                if (found->second.expires <= now) {
+                    table.erase(found);
+                }
+                else {
+                    expiries.emplace_back(found->second.expires, found->first); // resumed since
+                }
+            }
+            expiries.pop_front();
+        }
+    }
+
+    std::mutex mutex;
+    std::unordered_map<SessionToken, Resumable, SessionTokenHash> table;
+    std::deque<std::pair<Clock::time_point, SessionToken>> expiries;
+    Clock::duration lifetime = std::chrono::seconds(SESSION_TOKEN_TTL_S);
+    std::random_device random;
+};
+
+SessionTokens tokens;
+
+// SHA-256 (FIPS 180-4), the building block of the password hashes
+class Sha256 {
+public:
+    void update(const void* data, size_t length) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        size_t used = total % 64;
+        total += length;
+        if (used > 0) {
+            size_t taken = std::min(length, 64 - used);
+            memcpy(buffer + used, bytes, taken);
+            bytes += taken;
+            length -= taken;
+            if (used + taken < 64) {
+                return;
+            }
+            compress(buffer);
+        }
+        for (; length >= 64; bytes += 64, length -= 64) {
+            compress(bytes);
+        }
+        memcpy(buffer, bytes, length);
+    }
+
+    void finish(uint8_t (&digest)[32]) {
+        uint64_t bits = total * 8;
+        static const uint8_t padding[64] = { 0x80 };
+        update(padding, 1 + (119 - total % 64) % 64);
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++) {
+            length[i] = (uint8_t)(bits >> (56 - 8 * i));
+        }
+        update(length, sizeof(length));
+        for (int i = 0; i < 32; i++) {
+            digest[i] = (uint8_t)(state[i / 4] >> (24 - 8 * (i % 4)));
+        }
+    }
+
+private:
+    static uint32_t rotate(uint32_t value, int bits) {
+        return (value >> bits) | (value << (32 - bits));
+    }
+
+    void compress(const uint8_t* block) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+    uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    uint8_t buffer[64];
+    uint64_t total = 0; // bytes hashed so far
+};
+
+// PBKDF2-HMAC-SHA256 with one 32-byte block of output. The HMAC key is
+// absorbed once and its inner and outer states copied for every round.
+void pbkdf2(std::string_view password, const uint8_t* salt, size_t saltLength, unsigned iterations, uint8_t (&out)[32]) {
+    uint8_t key[64] = {};
+    if (password.size() > sizeof(key)) {
+        Sha256 digest;
+        digest.update(password.data(), password.size());
+        digest.finish(reinterpret_cast<uint8_t (&)[32]>(key));
+    }
+    else {
+        memcpy(key, password.data(), password.size());
+    }
+    uint8_t pad[64];
+    Sha256 inner, outer;
+    for (int i = 0; i < 64; i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+    inner.update(pad, sizeof(pad));
+    for (int i = 0; i < 64; i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+    outer.update(pad, sizeof(pad));
+
+    static const uint8_t blockIndex[4] = { 0, 0, 0, 1 };
+    uint8_t round[32];
+    Sha256 digest = inner;
+    digest.update(salt, saltLength);
+    digest.update(blockIndex, sizeof(blockIndex));
+    digest.finish(round);
+    for (unsigned i = 0; i < iterations; i++) {
+        if (i > 0) {
+            digest = inner;
+            digest.update(round, sizeof(round));
+            digest.finish(round);
+        }
+        digest = outer;
+        digest.update(round, sizeof(round));
+        digest.finish(round);
+        for (int j = 0; j < 32; j++) {
+            out[j] = i == 0 ? round[j] : out[j] ^ round[j];
+        }
+    }
+}
+
+// Compares without stopping at the first difference, so the time taken says nothing about where it is
+bool sameBytes(const void* a, const void* b, size_t length) {
+    const uint8_t* left = static_cast<const uint8_t*>(a);
+    const uint8_t* right = static_cast<const uint8_t*>(b);
+    uint8_t difference = 0;
+    for (size_t i = 0; i < length; i++) {
+        difference |= left[i] ^ right[i];
+    }
+    return difference == 0;
+}
+
+// Stored passwords are "pbkdf2-sha256$<iterations>$<salt>$<hash>", salt and
+// hash in hex. Anything else in the column is an old plaintext password.
+constexpr std::string_view PASSWORD_SCHEME = "pbkdf2-sha256$";
+const size_t PASSWORD_SALT_SIZE = 16;
+
+std::string hashPassword(std::string_view password, unsigned iterations, std::random_device& random) {
+    uint8_t salt[PASSWORD_SALT_SIZE];
+    for (size_t i = 0; i < sizeof(salt); i += 4) {
+        uint32_t bits = random();
+        memcpy(salt + i, &bits, 4);
+    }
+    uint8_t hash[32];
+    pbkdf2(password, salt, sizeof(salt), iterations, hash);
+
+    static const char digits[] = "0123456789abcdef";
+    std::string stored;
+    ReplyWriter<std::string>(stored) << PASSWORD_SCHEME << (int)iterations << "$";
+    for (uint8_t byte : salt) {
+        stored += digits[byte >> 4];
+        stored += digits[byte & 0xf];
+    }
+    stored += '$';
+    for (uint8_t byte : hash) {
+        stored += digits[byte >> 4];
+        stored += digits[byte & 0xf];
+    }
+    return stored;
+}
+
+// Reads hex digits into bytes; false unless text is exactly 2 * size of them
+bool parseHex(std::string_view text, uint8_t* bytes, size_t size) {
+    if (text.size() != 2 * size) {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (std::from_chars(text.data() + 2 * i, text.data() + 2 * i + 2, bytes[i], 16).ptr != text.data() + 2 * i + 2) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks a password against the Users column. rehash is set when the
+// password matched but is stored in plaintext or with fewer iterations.
+bool verifyPassword(std::string_view password, std::string_view stored, unsigned iterations, bool& rehash) {
+    if (stored.empty()) {
+        return false; // no password set; nothing matches it
+    }
+    if (stored.compare(0, PASSWORD_SCHEME.size(), PASSWORD_SCHEME) != 0) {
+        rehash = true;
+        return password.size() == stored.size() && sameBytes(password.data(), stored.data(), password.size());
+    }
+    stored.remove_prefix(PASSWORD_SCHEME.size());
+    size_t saltStart = stored.find('$');
+    size_t hashStart = stored.find('$', saltStart + 1);
+    if (hashStart == std::string_view::npos) {
+        return false;
+    }
+    unsigned storedIterations = 0;
+    std::from_chars(stored.data(), stored.data() + saltStart, storedIterations);
+    uint8_t salt[PASSWORD_SALT_SIZE];
+    uint8_t expected[32];
+    if (storedIterations == 0
+        || !parseHex(stored.substr(saltStart + 1, hashStart - saltStart - 1), salt, sizeof(salt))
+        || !parseHex(stored.substr(hashStart + 1), expected, sizeof(expected))) {
+        return false;
+    }
+    uint8_t hash[32];
+    pbkdf2(password, salt, sizeof(salt), storedIterations, hash);
+    rehash = storedIterations < iterations;
+    return sameBytes(hash, expected, sizeof(hash));
+}
+
+// A LOGIN whose user has been found, waiting for its password to be checked
+struct LoginCheck {
+    Connection* conn;
+    int userId; // -1 for a name no user has
+    bool root;
+    std::string username;
+    std::string password;
+    std::string stored; // the Users.password column
+};
+
+std::atomic<unsigned long long> passwordChecks(0);
+std::atomic<unsigned long long> passwordRehashes(0);
+
+// Slow password hashes run on their own few threads, never on the network
+// or DB threads, so a burst of logins only queues up here while other
+// commands carry on. The queue is bounded; past it, logins are turned away.
+// Results go back through the connection's CompletionQueue, as the writer's
+// do, and the connection waits for them the same way.
+class PasswordHasher {
+public:
+    void start(unsigned threadCount, unsigned hashIterations) {
+        iterations = hashIterations > 0 ? hashIterations : 1;
+        std::random_device random;
+        unknownUser = hashPassword(std::to_string(random()), iterations, random);
+        running = true;
+        for (unsigned i = 0; i < (threadCount > 0 ? threadCount : 1); i++) {
+            threads.emplace_back(&PasswordHasher::run, this);
+        }
+    }
+
+    // Checks whatever is still queued, then stops the threads
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        queued.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    // False when the queue is full or the pool has stopped
+    bool submit(LoginCheck&& check) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running || queue.size() >= HASH_QUEUE_MAX) {
+            return false;
+        }
+        queue.push_back(std::move(check));
+        queued.notify_one();
+        return true;
+    }
+
+private:
+    void run() {
+        std::random_device random; // salts for rehashed passwords
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            queued.wait(lock, [this] { return !running || !queue.empty(); });
+            if (queue.empty()) {
+                break;
+            }
+            LoginCheck check = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            verify(check, random);
+            lock.lock();
+        }
+    }
+
+    void verify(LoginCheck& check, std::random_device& random) {
+        passwordChecks++;
+        bool rehash = false;
+        WriteResult result("401 Unauthorized - Invalid credentials\n");
+        result.login = true;
+        // A name nobody has is checked against a dummy hash of the same cost,
+        // so the answer takes as long as for a real user's wrong password
+        bool matched = verifyPassword(check.password, check.userId >= 0 ? check.stored : unknownUser, iterations, rehash);
+        if (matched && check.userId >= 0) {
+            result.reply = "200 OK - Login successful\n";
+            result.userId = check.userId;
+            result.root = check.root;
+            result.username = std::move(check.username);
+            if (rehash) {
+                passwordRehashes++;
+                WriteRequest request(WRITE_PASSWORD);
+                request.userId = check.userId;
+                request.password = hashPassword(check.password, iterations, random);
+                writer.submit(std::move(request));
+            }
+        }
+        check.conn->completions->post(check.conn, std::move(result));
+    }
+
+    unsigned iterations = PASSWORD_HASH_ITERATIONS;
+    std::string unknownUser; // what logins for unknown names are checked against
+    bool running = false;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::deque<LoginCheck> queue;
+    std::vector<std::thread> threads;
+};
+
+PasswordHasher hasher;
+
+// Finds the user on the connection's own reader and hands the password to
+// the hashing threads, unknown names included so they take as long to fail;
+// the connection waits for the answer as for a write.
+// Returns the reply when there is one to send right away, else empty.
+std::string_view startLogin(Connection& conn, StatementCache& statements, std::string_view username, std::string_view password) {
+    CachedStatement stmt(statements, STMT_LOGIN);
+    sqlite3_bind_text(stmt, 1, username.data(), (int)username.size(), SQLITE_STATIC);
+    LoginCheck check{ &conn, -1, false, std::string(username), std::string(password), std::string() };
+    // A NULL or empty password lets nobody in; the check still runs, like an
+    // unknown name's, so the answer takes as long
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 2) > 0) {
+        check.userId = sqlite3_column_int(stmt, 0);
+        check.root = sqlite3_column_int(stmt, 1) != 0;
+        check.stored.assign(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)), sqlite3_column_bytes(stmt, 2));
+    }
+    if (!hasher.submit(std::move(check))) {
+        return "503 Busy - Try again later\n";
+    }
+    conn.awaitingWrite = true;
+    return std::string_view();
+}
+
+// Picks up the session a token was issued for, in place of LOGIN
+bool resumeSession(Connection& conn, std::string_view text) {
+    SessionToken token;
+    return SessionToken::parse(text, token) && tokens.resume(token, *conn.session);
+}
+
+// Splits a command line into whitespace-separated words. The words are views
+// into the line itself, so nothing is copied.
+class Tokenizer {
+public:
+    explicit Tokenizer(std::string_view line) : position(line.data()), end(line.data() + line.size()) {}
+
+    // The next word, or an empty view once the line is used up
+    std::string_view next() {
+        while (position != end && isSpace(*position)) {
+            position++;
+        }
+        const char* start = position;
+        while (position != end && !isSpace(*position)) {
+            position++;
+        }
+        return std::string_view(start, position - start);
+    }
+
+private:
+    static bool isSpace(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r'); // the characters operator>> skips
+    }
+
+    const char* position;
+    const char* end;
+};
+
+// Reads a number from the start of word; 0 when there is none. Unlike
+// operator>>, from_chars refuses a leading '+' and reads inf and nan.
+template <typename Number>
+Number parseNumber(std::string_view word) {
+    Number value = 0;
+    std::from_chars(word.data(), word.data() + word.size(), value);
+    return value;
+}
+
+enum CommandId {
+    CMD_UNKNOWN,
+    CMD_LOGIN,
+    CMD_BALANCE,
+    CMD_DEPOSIT,
+    CMD_LIST,
+    CMD_LOOKUP,
+    CMD_BUY,
+    CMD_SELL,
+    CMD_WHO,
+    CMD_LOGOUT,
+    CMD_STATS,
+    CMD_QUIT,
+    CMD_SHUTDOWN,
+    CMD_HELLO,
+    CMD_BATCH,
+    CMD_END,
+    CMD_CHECKOUT,
+    CMD_RESUME
+};
+
+struct CommandName {
+    std::string_view name;
+    CommandId id;
+};
+
+constexpr CommandName commandNames[] = {
+    { "LOGIN", CMD_LOGIN },
+    { "BALANCE", CMD_BALANCE },
+    { "DEPOSIT", CMD_DEPOSIT },
+    { "LIST", CMD_LIST },
+    { "LOOKUP", CMD_LOOKUP },
+    { "BUY", CMD_BUY },
+    { "SELL", CMD_SELL },
+    { "WHO", CMD_WHO },
+    { "LOGOUT", CMD_LOGOUT },
+    { "STATS", CMD_STATS },
+    { "QUIT", CMD_QUIT },
+    { "SHUTDOWN", CMD_SHUTDOWN },
+    { "HELLO", CMD_HELLO },
+    { "BATCH", CMD_BATCH },
+    { "END", CMD_END },
+    { "CHECKOUT", CMD_CHECKOUT },
+    { "RESUME", CMD_RESUME },
+};
+
+const size_t COMMAND_SLOTS = 32;
+
+// Perfect hash of the command names: first and last letter plus length. Adding
+// a command may need new multipliers; the static_assert below says so.
+constexpr size_t commandSlot(std::string_view word) {
+    return word.empty() ? 0 : (6 * word.front() + 2 * word.back() + 9 * word.size()) & (COMMAND_SLOTS - 1);
+}
+
+struct CommandTable {
+    CommandName slots[COMMAND_SLOTS] = {};
+    bool collision = false;
+};
+
+constexpr CommandTable buildCommandTable() {
+    CommandTable table;
+    for (const CommandName& command : commandNames) {
+        CommandName& slot = table.slots[commandSlot(command.name)];
+        table.collision = table.collision || !slot.name.empty();
+        slot = command;
+    }
+    return table;
+}
+
+constexpr CommandTable commandTable = buildCommandTable();
+static_assert(!commandTable.collision, "two commands hash to the same slot");
+
+// One hash and one comparison, whatever the command
+CommandId lookupCommand(std::string_view word) {
+    const CommandName& slot = commandTable.slots[commandSlot(word)];
+    return slot.name == word ? slot.id : CMD_UNKNOWN;
+}
+
+RateClass rateClass(CommandId id) {
+    switch (id) {
+    case CMD_LOGIN:
+    case CMD_RESUME:
+        return RATE_LOGIN;
+    case CMD_BALANCE:
+    case CMD_LOOKUP:
+    case CMD_WHO:
+    case CMD_STATS:
+        return RATE_READ;
+    case CMD_LIST:
+        return RATE_LIST;
+    case CMD_DEPOSIT:
+    case CMD_BUY:
+    case CMD_SELL:
+    case CMD_CHECKOUT:
+        return RATE_WRITE;
+    default:
+        return RATE_EXEMPT;
+    }
+}
+
+// Reads one key=value option of a filtered LIST: type, rarity, prefix, limit,
+// cursor or stream=1
+bool parseListOption(std::string_view option, ListQuery& query) {
+    size_t separator = option.find('=');
+    if (separator == std::string_view::npos || separator + 1 == option.size()) {
+        return false;
+    }
+    std::string_view key = option.substr(0, separator);
+    std::string_view value = option.substr(separator + 1);
+
+    if (key == "type") {
+        query.type = std::string(value);
+    }
+    else if (key == "rarity") {
+        query.rarity = std::string(value);
+    }
+    else if (key == "prefix") {
+        query.prefix = std::string(value);
+    }
+    else if (key == "cursor") {
+        query.cursor = std::string(value);
+    }
+    else if (key == "stream") {
+        query.stream = value == "1";
+        return value == "0" || value == "1";
+    }
+    else if (key == "limit") {
+        size_t limit = 0;
+        std::from_chars_result parsed = std::from_chars(value.data(), value.data() + value.size(), limit);
+        if (parsed.ptr != value.data() + value.size() || limit == 0 || limit > LIST_PAGE_MAX) {
+            return false;
+        }
+        query.limit = limit;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Commands on the user's account are refused up front when nobody is logged in
+bool requireLogin(Connection& conn) {
+    if (conn.session->userId >= 0) {
+        return true;
+    }
+    queueReply(conn, "401 Unauthorized - Not logged in\n");
+    return false;
+}
+
+// Takes one line inside a BATCH block: adds the command to the batch, or at
+// END hands the whole batch to the writer. Commands a batch cannot run are
+// kept as well, so their place in the results shows the error.
+void collectBatch(Connection& conn, CommandId id, Tokenizer& words) {
+    std::vector<WriteRequest>& commands = conn.batch->batch;
+    if (id == CMD_END) {
+        std::unique_ptr<WriteRequest> batch = std::move(conn.batch);
+        if (conn.batchTooLarge) {
+            queueReply(conn, "400 Batch too large\n");
+        }
+        else if (requireLogin(conn)) {
+            submitWrite(conn, *batch);
+        }
+        return;
+    }
+    if (commands.size() == BATCH_MAX_COMMANDS) {
+        conn.batchTooLarge = true;
+        return;
+    }
+
+    switch (id) {
+    case CMD_BALANCE:
+        commands.emplace_back(WRITE_BALANCE);
+        break;
+    case CMD_LOOKUP:
+        commands.emplace_back(WRITE_LOOKUP);
+        commands.back().name = words.next();
+        break;
+    case CMD_DEPOSIT:
+        commands.emplace_back(WRITE_DEPOSIT);
+        commands.back().amount = parseNumber<double>(words.next());
+        break;
+    case CMD_BUY:
+    case CMD_SELL:
+        commands.emplace_back(id == CMD_BUY ? WRITE_BUY : WRITE_SELL);
+        commands.back().name = words.next();
+        commands.back().quantity = parseNumber<int>(words.next());
+        break;
+    default:
+        commands.emplace_back(WRITE_REJECTED);
+        break;
+    }
+}
+
+// Executes one client command. Returns false when the connection should be closed.
+bool handleCommand(Connection& conn, StatementCache& statements, std::string_view command) {
+    Tokenizer words(command);
+    CommandId id = lookupCommand(words.next());
+    // A BATCH block counts as one write when it is run at END
+    RateClass limit = !conn.batch ? rateClass(id) : id == CMD_END ? RATE_WRITE : RATE_EXEMPT;
+    if (!rateLimiter.admit(conn, limit)) {
+        conn.batch.reset();
+        queueReply(conn, "429 Too Many Requests\n");
+        return true;
+    }
+    if (conn.batch) {
+        collectBatch(conn, id, words);
+        return true;
+    }
+
+    switch (id) {
+    case CMD_LOGIN: {
+        std::string_view username = words.next();
+        std::string_view reply = startLogin(conn, statements, username, words.next());
+        if (!reply.empty()) {
+            queueReply(conn, reply);
+        }
+        break;
+    }
+    case CMD_RESUME:
+        if (resumeSession(conn, words.next())) {
+            queueReply(conn, "200 OK - Session resumed\n");
+        }
+        else {
+            queueReply(conn, "401 Unauthorized - Invalid or expired token\n");
+        }
+        break;
+    case CMD_BALANCE: {
+        if (!requireLogin(conn)) {
+            break;
+        }
+        CachedStatement stmt(statements, STMT_BALANCE);
+        sqlite3_bind_int(stmt, 1, conn.session->userId);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            ReplyWriter<OutputQueue>(conn.output) << BALANCE_PREFIX << sqlite3_column_double(stmt, 0) << "\n";
+        }
+        break;
+    }
+    case CMD_DEPOSIT: {
+        if (!requireLogin(conn)) {
+            break;
+        }
+        WriteRequest request(WRITE_DEPOSIT);
+        request.amount = parseNumber<double>(words.next());
+        if (!std::isfinite(request.amount)) {
+            queueReply(conn, "400 Invalid amount\n");
+            break;
+        }
+        submitWrite(conn, request);
+        break;
+    }
+    case CMD_LIST: {
+        ListQuery query;
+        std::string_view option;
+        bool paged = false;
+        bool valid = true;
+        while (valid && !(option = words.next()).empty()) {
+            paged = true;
+            valid = parseListOption(option, query);
+        }
+        if (!valid) {
+            queueReply(conn, "400 Invalid LIST option\n");
+        }
+        else if (query.stream) {
+            conn.listing.reset(new ListStream());
+            conn.listing->query = query;
+        }
+        else if (paged) {
+            catalog.listPage(query, conn.output);
+        }
+        else {
+            queueReply(conn, catalog.list());
+        }
+        break;
+    }
+    case CMD_LOOKUP:
+        if (!catalog.describe(words.next(), conn.output)) {
+            queueReply(conn, "404 Not Found - Card not found\n");
+        }
+        break;
+    case CMD_BUY: {
+        if (!requireLogin(conn)) {
+            break;
+        }
+        WriteRequest request(WRITE_BUY);
+        request.name = words.next();
+        request.quantity = parseNumber<int>(words.next());
+        submitWrite(conn, request);
+        break;
+    }
+    case CMD_SELL: {
+        if (!requireLogin(conn)) {
+            break;
+        }
+        WriteRequest request(WRITE_SELL);
+        request.name = words.next();
+        request.quantity = parseNumber<int>(words.next());
+        submitWrite(conn, request);
+        break;
+    }
+    case CMD_CHECKOUT: {
+        // CHECKOUT <card> <quantity> [<card> <quantity> ...]
+        if (!requireLogin(conn)) {
+            break;
+        }
+        WriteRequest request(WRITE_CHECKOUT);
+        bool valid = true;
+        std::string_view card;
+        while (valid && !(card = words.next()).empty()) {
+            int quantity = parseNumber<int>(words.next());
+            valid = quantity > 0 && request.batch.size() < CHECKOUT_MAX_ITEMS;
+            request.batch.emplace_back(WRITE_BUY);
+            request.batch.back().name = card;
+            request.batch.back().quantity = quantity;
+        }
+        if (valid && !request.batch.empty()) {
+            submitWrite(conn, request);
+        }
+        else {
+            queueReply(conn, "400 Invalid cart\n");
+        }
+        break;
+    }
+    case CMD_WHO: {
+        ReplyWriter<OutputQueue> reply(conn.output);
+        reply << USERS_HEADER;
+        presence.list(reply);
+        break;
+    }
+    case CMD_LOGOUT:
+        tokens.revoke(conn.session->token);
+        logOut(*conn.session);
+        queueReply(conn, "200 OK - Logged out\n");
+        break;
+    case CMD_STATS: {
+        ReplyWriter<OutputQueue>(conn.output) << STATS_HEADER
+            << "statement_cache_hits: " << statementCacheHits.load() << "\n"
+            << "group_commits: " << groupCommits.load() << "\n"
+            << "group_commit_writes: " << groupCommitWrites.load() << "\n"
+            << "catalog_version: " << catalog.currentVersion() << "\n"
+            << "list_renders: " << listRenders.load() << "\n"
+            << "users_online: " << presence.size() << "\n"
+            << "session_tokens: " << tokens.size() << "\n"
+            << "password_checks: " << passwordChecks.load() << "\n"
+            << "password_rehashes: " << passwordRehashes.load() << "\n"
+            << "rate_limited_login: " << rateLimited[RATE_LOGIN].load() << "\n"
+            << "rate_limited_read: " << rateLimited[RATE_READ].load() << "\n"
+            << "rate_limited_list: " << rateLimited[RATE_LIST].load() << "\n"
+            << "rate_limited_write: " << rateLimited[RATE_WRITE].load() << "\n"
+            << "connections_active: " << connectionLimit.count() << "\n"
+            << "connections_shed: " << connectionsShed.load() << "\n"
+            << "session_user: " << (conn.session->userId >= 0 ? std::string_view(conn.session->username) : "-") << "\n"
+            << "session_root: " << (conn.session->root ? 1 : 0) << "\n"
+            << "session_commands: " << conn.session->commands << "\n"
+            << "session_writes: " << conn.session->writes << "\n";
+        break;
+    }
+    case CMD_QUIT:
+        queueReply(conn, "200 OK - Quitting\n");
+        return false;
+    case CMD_SHUTDOWN:
+        queueReply(conn, "200 OK - Server shutting down\n");
+        // The backends stop as soon as the flag drops. A send in flight still
+        // owns the output; the io_uring loop writes the rest once it is done.
+        if (!conn.sendPending) {
+            writeOutput(conn);
+        }
+        requestShutdown();
+        return false;
+    case CMD_BATCH:
+        conn.batch.reset(new WriteRequest(WRITE_BATCH));
+        conn.batchTooLarge = false;
+        break;
+    case CMD_END:
+        queueReply(conn, "400 END without BATCH\n");
+        break;
+    case CMD_HELLO: {
+        std::string_view protocol = words.next();
+        if (protocol == "BINARY") {
+            queueReply(conn, "200 OK - Binary protocol\n");
+            conn.binary = true; // whatever follows is framed
+        }
+        else if (protocol == "TEXT") {
+            queueReply(conn, "200 OK - Text protocol\n");
+        }
+        else {
+            queueReply(conn, "400 Unsupported protocol\n");
+        }
+        break;
+    }
+    case CMD_UNKNOWN:
+        queueReply(conn, "400 Unknown command\n");
+        break;
+    }
+    return true;
+}
+
+// Queues a binary response: its header, then length bytes of body
+void queueBinaryReply(Connection& conn, uint16_t opcode, uint16_t status, const void* body = nullptr, size_t length = 0) {
+    BinaryReplyHeader header;
+    header.length = (uint32_t)length;
+    header.opcode = opcode;
+    header.status = status;
+    conn.output.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    conn.output.append(static_cast<const char*>(body), length);
+}
+
+// The status code a text reply starts with
+uint16_t replyStatus(std::string_view reply) {
+    return parseNumber<uint16_t>(reply);
+}
+
+// Copies a request body into its struct; false when the size is wrong
+template <typename Body>
+bool readBody(std::string_view body, Body& out) {
+    if (body.size() != sizeof(Body)) {
+        return false;
+    }
+    memcpy(&out, body.data(), sizeof(Body));
+    return true;
+}
+
+// Executes one binary request. The cases return once they have queued a
+// reply or submitted a write; a malformed body breaks out to the 400 below,
+// as does an unknown opcode.
+void handleBinaryCommand(Connection& conn, StatementCache& statements, uint16_t opcode, std::string_view body) {
+    RateClass limit = opcode == BIN_LOGIN || opcode == BIN_RESUME ? RATE_LOGIN
+        : opcode == BIN_LIST ? RATE_LIST
+        : opcode == BIN_BALANCE || opcode == BIN_LOOKUP ? RATE_READ
+        : opcode == BIN_DEPOSIT || opcode == BIN_BUY || opcode == BIN_SELL ? RATE_WRITE : RATE_EXEMPT;
+    if (!rateLimiter.admit(conn, limit)) {
+        queueBinaryReply(conn, opcode, 429);
+        return;
+    }
+    bool account = opcode == BIN_BALANCE || opcode == BIN_DEPOSIT || opcode == BIN_BUY || opcode == BIN_SELL;
+    if (account && conn.session->userId < 0) {
+        queueBinaryReply(conn, opcode, 401);
+        return;
+    }
+
+    switch (opcode) {
+    case BIN_LOGIN: {
+        BinaryLogin login;
+        if (!readBody(body, login)) {
+            break;
+        }
+        conn.pendingOpcode = opcode;
+        std::string_view reply = startLogin(conn, statements, fieldText(login.username), fieldText(login.password));
+        if (!reply.empty()) {
+            queueBinaryReply(conn, opcode, replyStatus(reply));
+        }
+        return;
+    }
+    case BIN_RESUME: {
+        BinaryToken token;
+        if (!readBody(body, token)) {
+            break;
+        }
+        queueBinaryReply(conn, opcode, resumeSession(conn, std::string_view(token.token, sizeof(token.token))) ? 200 : 401);
+        return;
+    }
+    case BIN_BALANCE: {
+        if (!body.empty()) {
+            break;
+        }
+        CachedStatement stmt(statements, STMT_BALANCE);
+        sqlite3_bind_int(stmt, 1, conn.session->userId);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            BinaryBalance reply;
+            reply.balance = sqlite3_column_double(stmt, 0);
+            queueBinaryReply(conn, opcode, 200, &reply, sizeof(reply));
+        }
+        else {
+            queueBinaryReply(conn, opcode, 400);
+        }
+        return;
+    }
+    case BIN_DEPOSIT: {
+        BinaryDeposit deposit;
+        if (!readBody(body, deposit)) {
+            break;
+        }
+        if (!std::isfinite(deposit.amount)) {
+            break;
+        }
+        WriteRequest request(WRITE_DEPOSIT);
+        request.amount = deposit.amount;
+        conn.pendingOpcode = opcode;
+        submitWrite(conn, request);
+        return;
+    }
+    case BIN_LOOKUP: {
+        BinaryCardName lookup;
+        if (!readBody(body, lookup)) {
+            break;
+        }
+        BinaryCard card;
+        if (catalog.describe(fieldText(lookup.name), card)) {
+            queueBinaryReply(conn, opcode, 200, &card, sizeof(card));
+        }
+        else {
+            queueBinaryReply(conn, opcode, 404);
+        }
+        return;
+    }
+    case BIN_BUY:
+    case BIN_SELL: {
+        BinaryTrade trade;
+        if (!readBody(body, trade)) {
+            break;
+        }
+        WriteRequest request(opcode == BIN_BUY ? WRITE_BUY : WRITE_SELL);
+        request.name = fieldText(trade.name);
+        request.quantity = trade.quantity;
+        conn.pendingOpcode = opcode;
+        submitWrite(conn, request);
+        return;
+    }
+    case BIN_LIST: {
+        BinaryListRequest list;
+        if (!readBody(body, list) || list.limit > LIST_PAGE_MAX) {
+            break;
+        }
+        ListQuery query;
+        query.type = fieldText(list.type);
+        query.rarity = fieldText(list.rarity);
+        query.prefix = fieldText(list.prefix);
+        if (list.limit > 0) {
+            query.limit = list.limit;
+        }
+        if (list.cursor != 0) {
+            char cursor[16]; // the same value the text protocol shows in hex
+            std::to_chars_result result = std::to_chars(cursor, cursor + sizeof(cursor), list.cursor, 16);
+            query.cursor.assign(cursor, result.ptr - cursor);
+        }
+
+        // The BinaryListReply goes in front of the rows once they are counted
+        std::string reply(sizeof(BinaryListReply), '\0');
+        reply.reserve(sizeof(BinaryListReply) + query.limit * sizeof(BinaryCard));
+        BinaryListReply page;
+        size_t rows;
+        if (!catalog.listRecords(query, reply, rows, page.nextCursor)) {
+            break;
+        }
+        page.rows = (uint32_t)rows;
+        memcpy(&reply[0], &page, sizeof(page));
+        queueBinaryReply(conn, opcode, 200, reply.data(), reply.size());
+        return;
+    }
+    }
+    queueBinaryReply(conn, opcode, 400);
+}
+
+// Runs every complete command buffered on the connection in order (lines, or
+// frames once the connection is binary), so pipelined requests are not lost. Stops early, leaving the rest
+// buffered, once the output queue passes the high-water mark or a command has
+// gone to the writer thread.
+// Returns false when the connection should be closed.
+bool processInput(Connection& conn, StatementCache& statements) {
+    size_t start = 0;
+    size_t end;
+    while (true) {
+        // A streamed LIST produces its next slice whenever there is room for it
+        while (conn.listing && conn.output.size() < OUTPUT_HIGH_WATER) {
+            if (catalog.streamSlice(*conn.listing, OUTPUT_CHUNK_SIZE, conn.output)) {
+                conn.listing.reset();
+            }
+        }
+        if (conn.output.size() >= OUTPUT_HIGH_WATER) {
+            conn.paused = true;
+            break;
+        }
+        if (conn.binary) {
+            BinaryRequestHeader header;
+            if (conn.input.size() - start < sizeof(header)) {
+                break;
+            }
+            memcpy(&header, conn.input.data() + start, sizeof(header));
+            if (header.length > MAX_LINE - sizeof(header)) {
+                queueBinaryReply(conn, header.opcode, 400);
+                conn.input.clear();
+                return false;
+            }
+            if (conn.input.size() - start - sizeof(header) < header.length) {
+                break;
+            }
+            conn.session->commands++;
+            handleBinaryCommand(conn, statements, header.opcode, std::string_view(conn.input.data() + start + sizeof(header), header.length));
+            start += sizeof(header) + header.length;
+        }
+        else {
+            if ((end = conn.input.find('\n', start)) == std::string::npos) {
+                break;
+            }
+            size_t commandLength = end - start;
+            if (commandLength > 0 && conn.input[end - 1] == '\r') {
+                commandLength--;
+            }
+            std::string_view command(conn.input.data() + start, commandLength);
+            start = end + 1;
+            if (command.empty()) {
+                continue;
+            }
+            conn.session->commands++;
+            if (!handleCommand(conn, statements, command)) {
+                conn.input.clear();
+                return false;
+            }
+        }
+        if (conn.awaitingWrite) {
+            break;
+        }
+    }
+    conn.input.erase(0, start);
+
+    if (!conn.paused && !conn.awaitingWrite && conn.input.size() > MAX_LINE) {
+        queueReply(conn, "400 Command too long\n");
+        return false;
+    }
+    return true;
+}
+
+bool receiveData(Connection& conn, StatementCache& statements, const char* data, size_t length) {
+    conn.input.append(data, length);
+    if (conn.paused || conn.awaitingWrite) {
+        return true;
+    }
+    return processInput(conn, statements);
+}
+
+// Logs the connection in once its password has checked out, with a fresh session token
+void finishLogin(Connection& conn, const WriteResult& result) {
+    if (result.userId < 0) {
+        if (conn.binary) {
+            queueBinaryReply(conn, conn.pendingOpcode, replyStatus(result.reply));
+        }
+        else {
+            queueReply(conn, result.reply);
+        }
+        return;
+    }
+    // A LOGIN over a logged-in session replaces its token, as LOGOUT revokes it
+    tokens.revoke(conn.session->token);
+    logIn(*conn.session, result.userId, result.root, result.username);
+    tokens.issue(*conn.session);
+    if (conn.binary) {
+        BinaryToken token;
+        conn.session->token.format(token.token);
+        queueBinaryReply(conn, conn.pendingOpcode, 200, &token, sizeof(token));
+    }
+    else {
+        char token[32];
+        conn.session->token.format(token);
+        ReplyWriter<OutputQueue>(conn.output) << "200 OK - Login successful, token " << std::string_view(token, sizeof(token)) << "\n";
+    }
+}
+
+// Delivers the reply of a committed write and carries on with the commands queued behind it
+bool finishWrite(Connection& conn, StatementCache& statements, const WriteResult& result) {
+    conn.awaitingWrite = false;
+    if (conn.closing) {
+        return true;
+    }
+    if (result.login) {
+        finishLogin(conn, result);
+        return processInput(conn, statements);
+    }
+    if (conn.binary) {
+        queueBinaryReply(conn, conn.pendingOpcode, replyStatus(result.reply));
+    }
+    else if (!result.replies.empty()) {
+        queueReply(conn, result.replies);
+    }
+    else {
+        queueReply(conn, result.reply);
+    }
+    conn.session->writes++;
+    return processInput(conn, statements);
+}
+
+// Picks processing back up once a paused connection's output has drained
+bool resumeInput(Connection& conn, StatementCache& statements) {
+    if (conn.paused && !conn.awaitingWrite && conn.output.size() <= OUTPUT_LOW_WATER) {
+        conn.paused = false;
+        return processInput(conn, statements);
+    }
+    return true;
+}
+
+// The threads of the thread-per-connection backend. Shutdown wakes the ones
+// blocked on their sockets and waits until every one of them is done with
+// the server's shared state, so none is left running while main tears it down.
+class ClientThreads {
+public:
+    void started(SOCKET socket) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sockets.push_back(socket);
+        running++;
+    }
+
+    // Closes the client's socket under the lock, so stop() never touches a reused descriptor
+    void closeSocket(SOCKET socket) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sockets.erase(std::find(sockets.begin(), sockets.end(), socket));
+        closesocket(socket);
+    }
+
+    // The last call a client thread makes
+    void finished() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--running == 0) {
+            idle.notify_all();
+        }
+    }
+
+    void stop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (SOCKET socket : sockets) {
+            shutdown(socket, SD_BOTH);
+        }
+        idle.wait(lock, [this] { return running == 0; });
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::vector<SOCKET> sockets;
+    unsigned running = 0;
+};
+
+ClientThreads clientThreads;
+
+// Thread-per-connection backend, used where epoll is not available
+void serveClient(Connection& conn, StatementCache& statements) {
+    bool connected = true;
+    char buffer[RECV_BUFFER_SIZE];
+    CompletionQueue completions;
+    conn.completions = &completions;
+    while (connected && serverRunning) {
+        int bytesReceived = recv(conn.socket, buffer, RECV_BUFFER_SIZE, 0);
+        if (bytesReceived <= 0) {
+            break;
+        }
+        connected = receiveData(conn, statements, buffer, bytesReceived);
+        // Blocking writes drain the whole queue, so paused input resumes right
+        // away, and a write handed to the writer thread is simply waited for
+        while (writeOutput(conn) && connected && (conn.paused || conn.awaitingWrite)) {
+            if (conn.awaitingWrite) {
+                connected = finishWrite(conn, statements, completions.wait().result);
+            }
+            else {
+                connected = resumeInput(conn, statements);
+            }
+        }
+        if (!conn.output.empty()) {
+            break;
+        }
+    }
+    // The writer must be done with the connection before it goes away
+    if (conn.awaitingWrite) {
+        completions.wait();
+    }
+}
+
+void handleClient(std::unique_ptr<Connection> conn) {
+    std::unique_ptr<Reader> reader = readers.acquire();
+    if (reader) {
+        serveClient(*conn, reader->statements);
+        readers.release(std::move(reader));
+    }
+    clientThreads.closeSocket(conn->socket);
+    conn.reset();
+    clientThreads.finished();
+}
+
+void runThreadPerConnection() {
+    sockaddr_in clientAddr;
+    socklen_t clientAddrLen = sizeof(clientAddr);
+    while (serverRunning) {
+        SOCKET clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
+        if (clientSocket == INVALID_SOCKET) {
+            int error = WSAGetLastError();
+            if (!serverRunning) {
+                continue;
+            }
+            if (!outOfDescriptors(error) || !connectionLimit.shedWithSpare(serverSocket)) {
+                reportAcceptFailure(error);
+            }
+            // Out of descriptors accept() fails at once, client or not
+            if (outOfDescriptors(error)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_RETRY_MS));
+            }
+            continue;
+        }
+        if (!connectionLimit.admit(clientSocket)) {
+            continue;
+        }
+
+        std::unique_ptr<Connection> conn(new Connection());
+        conn->socket = clientSocket;
+        rateLimiter.attach(*conn);
+        clientThreads.started(clientSocket);
+        std::thread clientThread(handleClient, std::move(conn));
+        clientThread.detach();
+    }
+    clientThreads.stop();
+}
+
+#ifdef HAVE_EPOLL
+// A network backend thread that owns a set of client connections
+class EventLoop {
+public:
+    virtual ~EventLoop() {}
+    virtual bool valid() const = 0;
+    virtual void run() = 0;
+    virtual void wake() = 0;
+};
+
+// One epoll reactor per thread. Every loop watches the shared listening socket
+// (EPOLLEXCLUSIVE, so only one loop is woken per incoming connection) and
+// owns the client sockets it accepts, driven edge-triggered and non-blocking.
+class EpollLoop : public EventLoop {
+public:
+    explicit EpollLoop(std::unique_ptr<Reader> reader)
+        : reader(std::move(reader)), statements(this->reader->statements), completions([this] { wake(); }) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+        watchListener();
+    }
+
+    ~EpollLoop() {
+        for (auto& entry : connections) {
+            closesocket(entry.first);
+        }
+        close(wakeFd);
+        close(epollFd);
+    }
+
+    bool valid() const override {
+        return epollFd != -1 && wakeFd != -1;
+    }
 
-void handleClient(SOCKET clientSocket, sqlite3* db, int& currentUserId) {
-    bool connected = true;
-    char buffer[MAX_LINE];
-    while (connected) {
-        int bytesReceived = recv(clientSocket, buffer, MAX_LINE, 0);
-        if (bytesReceived > 0) {
-            buffer[bytesReceived] = '\0';
-            std::string command(buffer);
-            std::istringstream iss(command);
-            std::string action;
-            iss >> action;
-
-            std::lock_guard<std::mutex> lock(db_mutex); // Lock to avoid concurrent issues
-
-            if (action == "LOGIN") {
-                std::string username, password;
-                iss >> username >> password;
-
-                std::string query = "SELECT ID FROM Users WHERE username = ? AND password = ?";
-                sqlite3_stmt* stmt;
-                if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
-                    sqlite3_bind_text(stmt, 2, password.c_str(), -1, SQLITE_STATIC);
-
-                    if (sqlite3_step(stmt) == SQLITE_ROW) {
-                        currentUserId = sqlite3_column_int(stmt, 0);
-                        sqlite3_finalize(stmt);
-
-                        std::string updateLoginStatus = "UPDATE Users SET logged_in = 1 WHERE ID = ?";
-                        if (sqlite3_prepare_v2(db, updateLoginStatus.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                            sqlite3_bind_int(stmt, 1, currentUserId);
-                            sqlite3_step(stmt);
-                            sqlite3_finalize(stmt);
-                            send(clientSocket, "200 OK - Login successful\n", strlen("200 OK - Login successful\n"), 0);
-                        }
-                    }
-                    else {
-                        sqlite3_finalize(stmt);
-                        send(clientSocket, "401 Unauthorized - Invalid credentials\n", strlen("401 Unauthorized - Invalid credentials\n"), 0);
-                    }
+    void run() override {
+        epoll_event events[MAX_EPOLL_EVENTS];
+        while (serverRunning) {
+            int timeout = -1;
+            if (!listening) {
+                std::chrono::steady_clock::duration left = resumeAccepting - std::chrono::steady_clock::now();
+                if (left <= std::chrono::steady_clock::duration::zero()) {
+                    watchListener();
                 }
                 else {
-                    send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
+                    timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1;
                 }
             }
-            else if (action == "BALANCE") {
-                std::string query = "SELECT usd_balance FROM Users WHERE ID = ?";
-                sqlite3_stmt* stmt;
-                if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                    sqlite3_bind_int(stmt, 1, currentUserId);
-                    if (sqlite3_step(stmt) == SQLITE_ROW) {
-                        double balance = sqlite3_column_double(stmt, 0);
-                        std::ostringstream response;
-                        response << "200 OK - Your balance is " << balance << "\n";
-                        send(clientSocket, response.str().c_str(), response.str().length(), 0);
-                    }
-                    sqlite3_finalize(stmt);
-                }
-                else {
-                    send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
+            int count = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, timeout);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
                 }
+                std::cerr << "epoll_wait failed: " << errno << std::endl;
+                break;
             }
-            else if (action == "DEPOSIT") {
-                double amount;
-                iss >> amount;
-                std::string query = "UPDATE Users SET usd_balance = usd_balance + ? WHERE ID = ?";
-                sqlite3_stmt* stmt;
-                if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                    sqlite3_bind_double(stmt, 1, amount);
-                    sqlite3_bind_int(stmt, 2, currentUserId);
-                    sqlite3_step(stmt);
-                    sqlite3_finalize(stmt);
-                    send(clientSocket, "200 OK - Deposit successful\n", strlen("200 OK - Deposit successful\n"), 0);
+            for (int i = 0; i < count && serverRunning; i++) {
+                int fd = events[i].data.fd;
+                if (fd == serverSocket) {
+                    acceptConnections();
+                }
+                else if (fd == wakeFd) {
+                    finishWrites();
                 }
                 else {
-                    send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
+                    serviceConnection(fd);
                 }
             }
-            else if (action == "LIST") {
-                std::string query = "SELECT card_name, card_type, rarity, count FROM Pokemon_Cards WHERE owner_id IS NULL";
-                sqlite3_stmt* stmt;
-                if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                    std::ostringstream response;
-                    response << "200 OK - Available Pokmon cards:\n";
-                    while (sqlite3_step(stmt) == SQLITE_ROW) {
-                        response << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)) << " | "
-                            << "Type: " << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)) << " | "
-                            << "Rarity: " << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)) << " | "
-                            << "Count: " << sqlite3_column_int(stmt, 3) << "\n";
-                    }
-                    sqlite3_finalize(stmt);
-                    send(clientSocket, response.str().c_str(), response.str().length(), 0);
+        }
+    }
+
+    void wake() override {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+private:
+    void watchListener() {
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.fd = serverSocket;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &ev);
+        listening = true;
+    }
+
+    void acceptConnections() {
+        while (true) {
+            SOCKET clientSocket = accept4(serverSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clientSocket == INVALID_SOCKET) {
+                int error = errno;
+                // With the spare the waiting clients are all shed and the
+                // listener goes quiet until the next one
+                if (outOfDescriptors(error) && connectionLimit.shedWithSpare(serverSocket)) {
+                    return;
                 }
-                else {
-                    send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
+                if (error != EAGAIN && error != EWOULDBLOCK && error != EINTR) {
+                    reportAcceptFailure(error);
                 }
-            }
-            else if (action == "LOOKUP") {
-                std::string cardName;
-                iss >> cardName;
-                std::string query = "SELECT card_name, card_type, rarity, count FROM Pokemon_Cards WHERE card_name = ?";
-                sqlite3_stmt* stmt;
-                if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                    sqlite3_bind_text(stmt, 1, cardName.c_str(), -1, SQLITE_STATIC);
-                    if (sqlite3_step(stmt) == SQLITE_ROW) {
-                        std::ostringstream response;
-                        response << "200 OK - Card details:\n"
-                            << "Name: " << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)) << "\n"
-                            << "Type: " << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)) << "\n"
-                            << "Rarity: " << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)) << "\n"
-                            << "Count: " << sqlite3_column_int(stmt, 3) << "\n";
-                        send(clientSocket, response.str().c_str(), response.str().length(), 0);
-                    }
-                    else {
-                        send(clientSocket, "404 Not Found - Card not found\n", strlen("404 Not Found - Card not found\n"), 0);
-                    }
-                    sqlite3_finalize(stmt);
+                // Without it the listener stays readable, so stop watching it
+                // for a while rather than spin on a client there is no descriptor for
+                if (outOfDescriptors(error)) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, serverSocket, nullptr);
+                    listening = false;
+                    resumeAccepting = std::chrono::steady_clock::now() + std::chrono::milliseconds(ACCEPT_RETRY_MS);
                 }
-                else {
-                    send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
+                return;
+            }
+            if (!connectionLimit.admit(clientSocket)) {
+                continue;
+            }
+
+            epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            ev.data.fd = clientSocket;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &ev) != 0) {
+                closesocket(clientSocket);
+                connectionLimit.release();
+                continue;
+            }
+
+            std::unique_ptr<Connection> conn(new Connection());
+            conn->socket = clientSocket;
+            conn->completions = &completions;
+            rateLimiter.attach(*conn);
+            connections[clientSocket] = std::move(conn);
+        }
+    }
+
+    // Edge-triggered: alternate writing queued output and reading input until
+    // the socket would block. Reading stops while the connection is paused on
+    // its high-water mark; the next EPOLLOUT edge brings us back to drain it.
+    void serviceConnection(int fd) {
+        auto it = connections.find(fd);
+        if (it == connections.end()) {
+            return;
+        }
+        Connection& conn = *it->second;
+
+        char buffer[RECV_BUFFER_SIZE];
+        bool readable = true;
+        while (true) {
+            if (!writeOutput(conn)) {
+                closeConnection(fd);
+                return;
+            }
+            // Output left over means the socket is full and an EPOLLOUT edge will follow
+            bool socketFull = !conn.output.empty();
+            if (conn.closing) {
+                if (conn.output.empty()) {
+                    closeConnection(fd);
                 }
+                return;
+            }
+            if (!resumeInput(conn, statements)) {
+                conn.closing = true;
+                continue;
             }
-            else if (action == "BUY") {
-                std::string cardName;
-                int quantity;
-                iss >> cardName >> quantity;
-
-                double totalCost = quantity * PRICE_PER_CARD;
-
-                // Check if the user has enough balance and if there are enough cards in stock
-                std::string queryCheck = "SELECT count FROM Pokemon_Cards WHERE card_name = ? AND owner_id IS NULL";
-                sqlite3_stmt* stmt;
-                if (sqlite3_prepare_v2(db, queryCheck.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                    sqlite3_bind_text(stmt, 1, cardName.c_str(), -1, SQLITE_STATIC);
-                    if (sqlite3_step(stmt) == SQLITE_ROW) {
-                        int stockCount = sqlite3_column_int(stmt, 0);
-                        sqlite3_finalize(stmt);
-
-                        if (stockCount >= quantity) {
-                            // Check user's balance
-                            std::string balanceQuery = "SELECT usd_balance FROM Users WHERE ID = ?";
-                            sqlite3_prepare_v2(db, balanceQuery.c_str(), -1, &stmt, 0);
-                            sqlite3_bind_int(stmt, 1, currentUserId);
-
-                            if (sqlite3_step(stmt) == SQLITE_ROW) {
-                                double userBalance = sqlite3_column_double(stmt, 0);
-                                sqlite3_finalize(stmt);
-
-                                if (userBalance >= totalCost) {
-                                    // Proceed with the transaction
-                                    // Update Pokemon stock
-                                    std::string updateStockSQL = "UPDATE Pokemon_Cards SET count = count - ? WHERE card_name = ? AND owner_id IS NULL";
-                                    sqlite3_prepare_v2(db, updateStockSQL.c_str(), -1, &stmt, 0);
-                                    sqlite3_bind_int(stmt, 1, quantity);
-                                    sqlite3_bind_text(stmt, 2, cardName.c_str(), -1, SQLITE_STATIC);
-                                    sqlite3_step(stmt);
-                                    sqlite3_finalize(stmt);
-
-                                    // Assign ownership of the purchased cards to the user
-                                    std::string assignOwnershipSQL = "INSERT INTO Pokemon_Cards (card_name, card_type, rarity, count, owner_id) "
-                                        "VALUES (?, 'Unknown', 'Unknown', ?, ?)";
-                                    sqlite3_prepare_v2(db, assignOwnershipSQL.c_str(), -1, &stmt, 0);
-                                    sqlite3_bind_text(stmt, 1, cardName.c_str(), -1, SQLITE_STATIC);
-                                    sqlite3_bind_int(stmt, 2, quantity);
-                                    sqlite3_bind_int(stmt, 3, currentUserId);
-                                    sqlite3_step(stmt);
-                                    sqlite3_finalize(stmt);
-
-                                    // Update user's balance
-                                    std::string updateBalanceSQL = "UPDATE Users SET usd_balance = usd_balance - ? WHERE ID = ?";
-                                    sqlite3_prepare_v2(db, updateBalanceSQL.c_str(), -1, &stmt, 0);
-                                    sqlite3_bind_double(stmt, 1, totalCost);
-                                    sqlite3_bind_int(stmt, 2, currentUserId);
-                                    sqlite3_step(stmt);
-                                    sqlite3_finalize(stmt);
-
-                                    send(clientSocket, "200 OK - Purchase successful\n", strlen("200 OK - Purchase successful\n"), 0);
-                                }
-                                else {
-                                    send(clientSocket, "400 Insufficient funds\n", strlen("400 Insufficient funds\n"), 0);
-                                }
-                            }
-                            else {
-                                send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
-                            }
-                        }
-                        else {
-                            send(clientSocket, "400 Not enough stock\n", strlen("400 Not enough stock\n"), 0);
-                        }
-                    }
-                    else {
-                        sqlite3_finalize(stmt);
-                        send(clientSocket, "404 Card not found\n", strlen("404 Card not found\n"), 0);
-                    }
+            if (!socketFull && !conn.output.empty()) {
+                continue; // resumed commands queued output the socket can still take
+            }
+            if (conn.paused || conn.awaitingWrite || !readable) {
+                return;
+            }
+
+            ssize_t bytesReceived = recv(fd, buffer, RECV_BUFFER_SIZE, 0);
+            if (bytesReceived > 0) {
+                if (!receiveData(conn, statements, buffer, bytesReceived)) {
+                    conn.closing = true;
                 }
-                else {
-                    send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
+            }
+            else if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                readable = false;
+            }
+            else if (bytesReceived == 0 || errno != EINTR) {
+                closeConnection(fd);
+                return;
+            }
+        }
+    }
+
+    // Results from the writer thread, posted through the wake eventfd
+    void finishWrites() {
+        uint64_t value;
+        ssize_t ignored = read(wakeFd, &value, sizeof(value));
+        (void)ignored;
+
+        std::vector<CompletionQueue::Completion> finished;
+        completions.take(finished);
+        for (auto& completion : finished) {
+            Connection& conn = *completion.conn;
+            if (!finishWrite(conn, statements, completion.result)) {
+                conn.closing = true;
+            }
+            serviceConnection(conn.socket);
+        }
+    }
+
+    void closeConnection(int fd) {
+        Connection& conn = *connections[fd];
+        if (conn.awaitingWrite) {
+            // The writer still holds on to the connection; close once its reply is back
+            conn.closing = true;
+            conn.input.clear();
+            return;
+        }
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        closesocket(fd);
+        connections.erase(fd);
+    }
+
+    std::unique_ptr<Reader> reader;
+    StatementCache& statements;
+    CompletionQueue completions;
+    int epollFd;
+    int wakeFd;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    bool listening = false;
+    std::chrono::steady_clock::time_point resumeAccepting; // while not listening
+};
+
+#ifdef HAVE_IO_URING
+// io_uring backend, one ring per thread, driven through the raw syscalls so
+// there is no liburing dependency. The listening socket is served by a
+// multishot accept, each client by a multishot recv that picks its buffers
+// from a pool of buffers provided to the kernel up front (and handed back one
+// at a time once a command has been processed), and every SQE produced
+// while handling a batch of completions goes out in one io_uring_enter().
+class UringLoop : public EventLoop {
+public:
+    explicit UringLoop(std::unique_ptr<Reader> reader)
+        : reader(std::move(reader)), statements(this->reader->statements), completions([this] { wake(); }) {
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd != -1 && setupRing() && setupBuffers()) {
+            ready = true;
+        }
+    }
+
+    ~UringLoop() {
+        if (ringFd != -1) {
+            close(ringFd);
+        }
+        for (auto& entry : connections) {
+            closesocket(entry.first->socket);
+        }
+        connections.clear();
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqEntries * sizeof(io_uring_sqe));
+        }
+        if (ringMemory != MAP_FAILED) {
+            munmap(ringMemory, ringSize);
+        }
+        if (wakeFd != -1) {
+            close(wakeFd);
+        }
+    }
+
+    bool valid() const override {
+        return ready;
+    }
+
+    void run() override {
+        armAccept();
+        armWake();
+        while (serverRunning) {
+            if (submitAndWait(1) < 0 && errno != EINTR) {
+                std::cerr << "io_uring_enter failed: " << errno << std::endl;
+                break;
+            }
+
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            while (head != tail && serverRunning) {
+                io_uring_cqe cqe = cqes[head & cqMask];
+                head++;
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+                handleCompletion(cqe);
+            }
+        }
+        drainSends();
+    }
+
+    void wake() override {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+private:
+    // Operation tags live in the low bits of user_data, next to the connection pointer
+    enum : uint64_t { OP_ACCEPT = 1, OP_WAKE = 2, OP_RECV = 3, OP_SEND = 4, OP_CANCEL = 5, OP_BUFFERS = 6, OP_TIMEOUT = 7, OP_MASK = 7 };
+
+    struct UringConnection : Connection {
+        iovec sendBuffers[MAX_IOVECS]; // read by the kernel while a send is in flight
+        msghdr sendHeader;
+        int pendingOps = 0;
+        bool recvArmed = false;
+        bool recvCancelled = false;
+        bool tearingDown = false;
+        bool writePending = false; // counted in pendingOps while the writer holds the connection
+    };
+
+    static uint64_t userData(UringConnection* uc, uint64_t op) {
+        return reinterpret_cast<uint64_t>(uc) | op;
+    }
+
+    bool setupRing() {
+        io_uring_params params = {};
+        ringFd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        if (ringFd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            return false;
+        }
+
+        sqEntries = params.sq_entries;
+        size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        ringSize = sqSize > cqSize ? sqSize : cqSize;
+        ringMemory = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqEntries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (ringMemory == MAP_FAILED || sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char* ring = (char*)ringMemory;
+        sqHead = (unsigned*)(ring + params.sq_off.head);
+        sqTail = (unsigned*)(ring + params.sq_off.tail);
+        sqMask = *(unsigned*)(ring + params.sq_off.ring_mask);
+        cqHead = (unsigned*)(ring + params.cq_off.head);
+        cqTail = (unsigned*)(ring + params.cq_off.tail);
+        cqMask = *(unsigned*)(ring + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(ring + params.cq_off.cqes);
+
+        // SQE slots are always submitted in order, so the index array is the identity
+        unsigned* sqArray = (unsigned*)(ring + params.sq_off.array);
+        for (unsigned i = 0; i < sqEntries; i++) {
+            sqArray[i] = i;
+        }
+        sqLocalTail = *sqTail;
+        if (!kernelSupported(params)) {
+            std::cerr << "The io_uring backend needs Linux 6.0 or later." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Multishot recv needs 6.0, multishot accept 5.19 and CQE_SKIP_SUCCESS
+    // 5.17. The multishot flags cannot be probed, so SEND_ZC, which arrived in
+    // 6.0 as well, stands in for them.
+    bool kernelSupported(const io_uring_params& params) {
+        if (!(params.features & IORING_FEAT_CQE_SKIP)) {
+            return false;
+        }
+        const unsigned probeOps = 256;
+        std::vector<char> memory(sizeof(io_uring_probe) + probeOps * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(memory.data());
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, probeOps) < 0) {
+            return false;
+        }
+        static const unsigned needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+            IORING_OP_ASYNC_CANCEL, IORING_OP_PROVIDE_BUFFERS, IORING_OP_SEND_ZC };
+        for (unsigned op : needed) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool setupBuffers() {
+        buffers.resize((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+        provideBuffers(0, URING_BUFFER_COUNT);
+        return true;
+    }
+
+    // Hands buffers [firstId, firstId + count) to the kernel for buffer-select recv
+    void provideBuffers(unsigned firstId, unsigned count) {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = (int)count;
+        sqe->addr = reinterpret_cast<uint64_t>(&buffers[(size_t)firstId * URING_BUFFER_SIZE]);
+        sqe->len = URING_BUFFER_SIZE;
+        sqe->off = firstId;
+        sqe->buf_group = 0;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = OP_BUFFERS;
+    }
+
+    io_uring_sqe* getSqe() {
+        if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            submitAndWait(0);
+        }
+        io_uring_sqe* sqe = &sqes[sqLocalTail & sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqLocalTail++;
+        return sqe;
+    }
+
+    int submitAndWait(unsigned waitFor) {
+        unsigned toSubmit = sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor,
+            waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    }
+
+    void armAccept() {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = serverSocket;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = OP_ACCEPT;
+    }
+
+    // Accepts again after ACCEPT_RETRY_MS; the shutdown drain's own timeout
+    // is told apart by carrying no address
+    void armAcceptRetry() {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<uint64_t>(&acceptRetry);
+        sqe->len = 1;
+        sqe->user_data = reinterpret_cast<uint64_t>(&acceptRetry) | OP_TIMEOUT;
+    }
+
+    void armWake() {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = wakeFd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = OP_WAKE;
+    }
+
+    void armRecv(UringConnection* uc) {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = uc->socket;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = userData(uc, OP_RECV);
+        uc->recvArmed = true;
+        uc->recvCancelled = false;
+        uc->pendingOps++;
+    }
+
+    void cancelRecv(UringConnection* uc) {
+        if (!uc->recvArmed || uc->recvCancelled) {
+            return;
+        }
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = userData(uc, OP_RECV);
+        sqe->user_data = OP_CANCEL;
+        uc->recvCancelled = true;
+    }
+
+    // One gathered sendmsg straight out of the output queue; the queued chunks
+    // are sealed so nothing appended meanwhile can move them under the kernel
+    void flush(UringConnection* uc) {
+        if (uc->sendPending || uc->output.empty()) {
+            return;
+        }
+        memset(&uc->sendHeader, 0, sizeof(uc->sendHeader));
+        uc->sendHeader.msg_iov = uc->sendBuffers;
+        uc->sendHeader.msg_iovlen = uc->output.gather(uc->sendBuffers, MAX_IOVECS);
+        uc->output.seal();
+
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = uc->socket;
+        sqe->addr = reinterpret_cast<uint64_t>(&uc->sendHeader);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userData(uc, OP_SEND);
+        uc->sendPending = true;
+        uc->pendingOps++;
+    }
+
+    void closeConnection(UringConnection* uc) {
+        if (!uc->tearingDown) {
+            uc->tearingDown = true;
+            cancelRecv(uc);
+        }
+        // The kernel may still reference the connection until its last operation completes
+        if (uc->pendingOps == 0) {
+            closesocket(uc->socket);
+            connections.erase(uc);
+        }
+    }
+
+    void handleCompletion(const io_uring_cqe& cqe) {
+        uint64_t op = cqe.user_data & OP_MASK;
+        UringConnection* uc = reinterpret_cast<UringConnection*>(cqe.user_data & ~OP_MASK);
+
+        switch (op) {
+        case OP_ACCEPT: {
+            bool backOff = false;
+            if (cqe.res >= 0 && connectionLimit.admit(cqe.res)) {
+                std::unique_ptr<UringConnection> owned(new UringConnection());
+                owned->socket = cqe.res;
+                owned->completions = &completions;
+                rateLimiter.attach(*owned);
+                UringConnection* accepted = owned.get();
+                connections[accepted] = std::move(owned);
+                armRecv(accepted);
+            }
+            else if (outOfDescriptors(-cqe.res)) {
+                // Turn the waiting clients away with the spare descriptor. An
+                // accept would fail again at once either way, so pause it.
+                if (!connectionLimit.shedWithSpare(serverSocket)) {
+                    reportAcceptFailure(-cqe.res);
                 }
+                backOff = true;
             }
-            else if (action == "SELL") {
-                std::string cardName;
-                int quantity;
-                iss >> cardName >> quantity;
-                double totalEarnings = quantity * PRICE_PER_CARD;
-
-                std::string queryCheck = "SELECT count FROM Pokemon_Cards WHERE card_name = ? AND owner_id = ?";
-                sqlite3_stmt* stmt;
-                if (sqlite3_prepare_v2(db, queryCheck.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                    sqlite3_bind_text(stmt, 1, cardName.c_str(), -1, SQLITE_STATIC);
-                    sqlite3_bind_int(stmt, 2, currentUserId);
-
-                    if (sqlite3_step(stmt) == SQLITE_ROW) {
-                        int stockCount = sqlite3_column_int(stmt, 0);
-
-                        if (stockCount >= quantity) {
-                            sqlite3_finalize(stmt);
-
-                            std::string updateStockSQL = "UPDATE Pokemon_Cards SET count = count - ? WHERE card_name = ? AND owner_id = ?";
-                            std::string updateBalanceSQL = "UPDATE Users SET usd_balance = usd_balance + ? WHERE ID = ?";
-                            sqlite3_stmt* updateStmt;
-
-                            if (sqlite3_prepare_v2(db, updateStockSQL.c_str(), -1, &updateStmt, 0) == SQLITE_OK) {
-                                sqlite3_bind_int(updateStmt, 1, quantity);
-                                sqlite3_bind_text(updateStmt, 2, cardName.c_str(), -1, SQLITE_STATIC);
-                                sqlite3_bind_int(updateStmt, 3, currentUserId);
-                                sqlite3_step(updateStmt);
-                                sqlite3_finalize(updateStmt);
-                            }
-
-                            if (sqlite3_prepare_v2(db, updateBalanceSQL.c_str(), -1, &updateStmt, 0) == SQLITE_OK) {
-                                sqlite3_bind_double(updateStmt, 1, totalEarnings);
-                                sqlite3_bind_int(updateStmt, 2, currentUserId);
-                                sqlite3_step(updateStmt);
-                                sqlite3_finalize(updateStmt);
-                            }
-
-                            send(clientSocket, "200 OK - Sell successful\n", strlen("200 OK - Sell successful\n"), 0);
-                        }
-                        else {
-                            send(clientSocket, "400 Not enough stock to sell\n", strlen("400 Not enough stock to sell\n"), 0);
-                        }
-                    }
-                    else {
-                        send(clientSocket, "404 Not Found - Card not owned by user\n", strlen("404 Not Found - Card not owned by user\n"), 0);
-                        sqlite3_finalize(stmt);
-                    }
+            else if (cqe.res < 0 && cqe.res != -ECANCELED) {
+                reportAcceptFailure(-cqe.res);
+            }
+            // EINVAL means the accept itself was refused; re-arming would only spin
+            if (!(cqe.flags & IORING_CQE_F_MORE) && serverRunning && cqe.res != -EINVAL) {
+                if (backOff) {
+                    armAcceptRetry();
                 }
                 else {
-                    send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
+                    armAccept();
                 }
             }
-            else if (action == "WHO") {
-                std::string query = "SELECT username FROM Users WHERE logged_in = 1";
-                sqlite3_stmt* stmt;
-                if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                    std::ostringstream response;
-                    response << "200 OK - Logged-in users:\n";
-                    while (sqlite3_step(stmt) == SQLITE_ROW) {
-                        response << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)) << "\n";
-                    }
-                    sqlite3_finalize(stmt);
-                    send(clientSocket, response.str().c_str(), response.str().length(), 0);
-                }
-                else {
-                    send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
+            break;
+        }
+        case OP_TIMEOUT:
+            if (serverRunning) {
+                armAccept();
+            }
+            break;
+        case OP_WAKE: {
+            uint64_t value;
+            ssize_t ignored = read(wakeFd, &value, sizeof(value));
+            (void)ignored;
+            if (serverRunning) {
+                armWake();
+            }
+            finishWrites();
+            break;
+        }
+        case OP_RECV:
+            handleRecv(uc, cqe);
+            break;
+        case OP_SEND:
+            handleSend(uc, cqe);
+            break;
+        case OP_BUFFERS:
+            std::cerr << "Providing io_uring buffers failed: " << -cqe.res << std::endl;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void handleRecv(UringConnection* uc, const io_uring_cqe& cqe) {
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        if (!more) {
+            uc->recvArmed = false;
+            uc->pendingOps--;
+        }
+
+        if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+            uint16_t bufferId = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (!uc->tearingDown && !uc->closing) {
+                const char* data = &buffers[(size_t)bufferId * URING_BUFFER_SIZE];
+                if (!receiveData(*uc, statements, data, cqe.res)) {
+                    uc->closing = true;
                 }
+                trackWrite(uc);
+            }
+            provideBuffers(bufferId, 1);
+        }
+
+        if (uc->tearingDown) {
+            closeConnection(uc);
+            return;
+        }
+        if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED)) {
+            closeConnection(uc);
+            return;
+        }
+        afterIo(uc);
+    }
+
+    void handleSend(UringConnection* uc, const io_uring_cqe& cqe) {
+        uc->sendPending = false;
+        uc->pendingOps--;
+
+        if (cqe.res < 0 || uc->tearingDown) {
+            closeConnection(uc);
+            return;
+        }
+
+        // A short send leaves the rest queued for the next flush
+        uc->output.consume(cqe.res);
+        if (!uc->closing && !resumeInput(*uc, statements)) {
+            uc->closing = true;
+        }
+        trackWrite(uc);
+        afterIo(uc);
+    }
+
+    // A command handed to the writer thread keeps the connection alive until its result is back
+    void trackWrite(UringConnection* uc) {
+        if (uc->awaitingWrite && !uc->writePending) {
+            uc->writePending = true;
+            uc->pendingOps++;
+        }
+    }
+
+    void finishWrites() {
+        std::vector<CompletionQueue::Completion> finished;
+        completions.take(finished);
+        for (auto& completion : finished) {
+            UringConnection* uc = static_cast<UringConnection*>(completion.conn);
+            uc->writePending = false;
+            uc->pendingOps--;
+            if (uc->tearingDown) {
+                uc->awaitingWrite = false;
+                closeConnection(uc);
+                continue;
+            }
+            if (!finishWrite(*uc, statements, completion.result)) {
+                uc->closing = true;
+            }
+            trackWrite(uc);
+            afterIo(uc);
+        }
+    }
+
+    // At shutdown: waits a moment for the sends in flight, then writes what
+    // is left straight to the sockets, a SHUTDOWN's own reply among it
+    void drainSends() {
+        unsigned inFlight = 0;
+        for (auto& entry : connections) {
+            inFlight += entry.first->sendPending ? 1 : 0;
+        }
+        __kernel_timespec timeout = { URING_DRAIN_TIMEOUT_S, 0 };
+        if (inFlight > 0) {
+            io_uring_sqe* sqe = getSqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = reinterpret_cast<uint64_t>(&timeout);
+            sqe->len = 1;
+            sqe->user_data = OP_TIMEOUT;
+        }
+        bool expired = false;
+        while (inFlight > 0 && !expired) {
+            if (submitAndWait(1) < 0 && errno != EINTR) {
+                break;
             }
-            else if (action == "LOGOUT") {
-                std::string query = "UPDATE Users SET logged_in = 0 WHERE ID = ?";
-                sqlite3_stmt* stmt;
-                if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, 0) == SQLITE_OK) {
-                    sqlite3_bind_int(stmt, 1, currentUserId);
-                    sqlite3_step(stmt);
-                    sqlite3_finalize(stmt);
-                    send(clientSocket, "200 OK - Logged out\n", strlen("200 OK - Logged out\n"), 0);
-                    currentUserId = -1;
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            while (head != tail) {
+                io_uring_cqe cqe = cqes[head & cqMask];
+                head++;
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+                UringConnection* uc = reinterpret_cast<UringConnection*>(cqe.user_data & ~OP_MASK);
+                if ((cqe.user_data & OP_MASK) == OP_SEND) {
+                    uc->sendPending = false;
+                    inFlight--;
+                    uc->output.consume(cqe.res > 0 ? cqe.res : 0);
                 }
-                else {
-                    send(clientSocket, "400 Database error\n", strlen("400 Database error\n"), 0);
+                else if (cqe.user_data == OP_TIMEOUT) { // not the accept back-off
+                    expired = true;
                 }
             }
-            else if (action == "QUIT") {
-                send(clientSocket, "200 OK - Quitting\n", strlen("200 OK - Quitting\n"), 0);
-                connected = false;
+        }
+        for (auto& entry : connections) {
+            UringConnection* uc = entry.first;
+            if (!uc->sendPending && setNonBlocking(uc->socket)) {
+                writeOutput(*uc);
             }
-            else if (action == "SHUTDOWN") {
-                send(clientSocket, "200 OK - Server shutting down\n", strlen("200 OK - Server shutting down\n"), 0);
-                closesocket(clientSocket);
-                closesocket(serverSocket);
-                sqlite3_close(db);
-                WSACleanup();
-                return;
+        }
+    }
+
+    // Pushes out new output and decides whether the connection keeps reading
+    void afterIo(UringConnection* uc) {
+        flush(uc);
+        if (uc->closing) {
+            cancelRecv(uc);
+            if (!uc->sendPending) {
+                closeConnection(uc);
             }
-            else {
-                send(clientSocket, "400 Unknown command\n", strlen("400 Unknown command\n"), 0);
+        }
+        else if (uc->paused || (uc->awaitingWrite && uc->input.size() > MAX_LINE)) {
+            cancelRecv(uc); // backpressure: stop reading until sends drain the queue
+        }
+        else if (!uc->recvArmed) {
+            armRecv(uc); // cancelled for backpressure, or the buffer pool ran dry
+        }
+    }
+
+    std::unique_ptr<Reader> reader;
+    StatementCache& statements;
+    CompletionQueue completions;
+    bool ready = false;
+    int wakeFd = -1;
+    int ringFd = -1;
+    __kernel_timespec acceptRetry = { ACCEPT_RETRY_MS / 1000, ACCEPT_RETRY_MS % 1000 * 1000000LL };
+    void* ringMemory = MAP_FAILED;
+    size_t ringSize = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    unsigned sqEntries = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqLocalTail = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+    std::vector<char> buffers;
+    std::unordered_map<UringConnection*, std::unique_ptr<UringConnection>> connections;
+};
+#endif
+
+std::vector<std::unique_ptr<EventLoop>> eventLoops;
+
+// Each loop thread gets a reader connection of its own for the read commands
+EventLoop* createEventLoop(const std::string& backend) {
+    std::unique_ptr<Reader> reader = readers.acquire();
+    if (!reader) {
+        return nullptr;
+    }
+#ifdef HAVE_IO_URING
+    if (backend == "io_uring") {
+        return new UringLoop(std::move(reader));
+    }
+#endif
+    return new EpollLoop(std::move(reader));
+}
+
+bool runEventLoops(const ServerConfig& config) {
+    // Only the epoll loops call accept() themselves, draining it until EAGAIN
+    if (config.backend == "epoll" && !setNonBlocking(serverSocket)) {
+        std::cerr << "Could not make listening socket non-blocking: " << errno << std::endl;
+        return false;
+    }
+
+    for (unsigned i = 0; i < config.eventLoopThreads; i++) {
+        std::unique_ptr<EventLoop> loop(createEventLoop(config.backend));
+        if (!loop || !loop->valid()) {
+            std::cerr << "Could not create " << config.backend << " event loop: " << errno << std::endl;
+            eventLoops.clear();
+            return false;
+        }
+        eventLoops.push_back(std::move(loop));
+    }
+
+    std::cout << "Running " << config.eventLoopThreads << " " << config.backend << " event loop thread(s)." << std::endl;
+
+    std::vector<std::thread> threads;
+    for (auto& loop : eventLoops) {
+        threads.emplace_back(&EventLoop::run, loop.get());
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    // The hashing threads and the writer may still post results to the loops;
+    // a rehashed password still goes to the writer
+    hasher.stop();
+    writer.stop();
+    eventLoops.clear();
+    return true;
+}
+#endif
+
+void requestShutdown() {
+    serverRunning = false;
+#ifdef HAVE_EPOLL
+    for (auto& loop : eventLoops) {
+        loop->wake();
+    }
+#endif
+    // Unblock the accept() of the thread-per-connection backend
+#ifdef _WIN32
+    closesocket(serverSocket);
+#else
+    shutdown(serverSocket, SD_BOTH);
+#endif
+}
+
+// A mix of commands for --bench-parser, weighted towards reads as traffic is
+const char* const benchmarkCommands[] = {
+    "LOGIN ash pikachu123",
+    "BALANCE",
+    "LOOKUP Pikachu",
+    "LOOKUP Charizard",
+    "LIST",
+    "LIST type=Fire limit=50",
+    "DEPOSIT 125.50",
+    "BUY Bulbasaur 2",
+    "SELL Squirtle 1",
+    "BALANCE",
+    "WHO",
+    "STATS",
+    "LOGOUT",
+};
+
+// Parses one command the way handleCommand did before Tokenizer: the line
+// copied out of the input, an istringstream, a string per word and a chain of
+// comparisons. Returns something derived from the words so nothing is elided.
+size_t parseWithStream(const std::string& input, size_t start, size_t length) {
+    std::string command = input.substr(start, length);
+    std::istringstream iss(command);
+    std::string action, name, password, option;
+    double amount = 0;
+    int quantity = 0;
+    size_t options = 0;
+    iss >> action;
+    if (action == "LOGIN") {
+        iss >> name >> password;
+    }
+    else if (action == "BALANCE") {
+    }
+    else if (action == "DEPOSIT") {
+        iss >> amount;
+    }
+    else if (action == "LIST") {
+        while (iss >> option) {
+            options++;
+        }
+    }
+    else if (action == "LOOKUP") {
+        iss >> name;
+    }
+    else if (action == "BUY") {
+        iss >> name >> quantity;
+    }
+    else if (action == "SELL") {
+        iss >> name >> quantity;
+    }
+    return name.size() + password.size() + options + quantity + (size_t)amount;
+}
+
+// The same through Tokenizer, parseNumber and the command table
+size_t parseInPlace(std::string_view command) {
+    Tokenizer words(command);
+    std::string_view name, password;
+    double amount = 0;
+    int quantity = 0;
+    size_t options = 0;
+    switch (lookupCommand(words.next())) {
+    case CMD_LOGIN:
+        name = words.next();
+        password = words.next();
+        break;
+    case CMD_DEPOSIT:
+        amount = parseNumber<double>(words.next());
+        break;
+    case CMD_LIST:
+        while (!words.next().empty()) {
+            options++;
+        }
+        break;
+    case CMD_LOOKUP:
+        name = words.next();
+        break;
+    case CMD_BUY:
+    case CMD_SELL:
+        name = words.next();
+        quantity = parseNumber<int>(words.next());
+        break;
+    default:
+        break;
+    }
+    return name.size() + password.size() + options + quantity + (size_t)amount;
+}
+
+// --bench-parser=N: frames and parses the command mix N times with each parser
+// and prints the cost per command. Commands are only parsed, not executed.
+void benchmarkParser(unsigned long passes) {
+    std::string input;
+    for (const char* command : benchmarkCommands) {
+        input += command;
+        input += "\n";
+    }
+    double commands = (double)passes * (sizeof(benchmarkCommands) / sizeof(benchmarkCommands[0]));
+    size_t checksum = 0;
+
+    auto run = [&](const char* label, auto parse) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        for (unsigned long pass = 0; pass < passes; pass++) {
+            size_t start = 0;
+            size_t end;
+            while ((end = input.find('\n', start)) != std::string::npos) {
+                checksum += parse(start, end - start);
+                start = end + 1;
             }
         }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - begin;
+        std::cout << label << ": " << elapsed.count() / commands << " ns/command" << std::endl;
+    };
+    run("istringstream parser", [&](size_t start, size_t length) {
+        return parseWithStream(input, start, length);
+    });
+    run("in-place parser", [&](size_t start, size_t length) {
+        return parseInPlace(std::string_view(input.data() + start, length));
+    });
+    std::cout << "checksum: " << checksum << std::endl;
+}
+
+// "<class>=<per second>/<burst>", e.g. list=50/100; a rate of 0 lifts the limit
+bool parseRateLimit(const std::string& option, ServerConfig& config) {
+    static const char* const classNames[RATE_CLASSES] = { "login", "read", "list", "write" };
+    size_t equals = option.find('=');
+    size_t slash = option.find('/', equals);
+    for (int i = 0; i < RATE_CLASSES; i++) {
+        if (option.compare(0, equals, classNames[i]) == 0 && equals != std::string::npos) {
+            RateLimit& limit = config.rateLimits[i];
+            limit.perSecond = std::stod(option.substr(equals + 1));
+            limit.burst = slash != std::string::npos ? std::stod(option.substr(slash + 1)) : std::max(limit.perSecond, 1.0);
+            return true;
+        }
     }
-    closesocket(clientSocket);
+    return false;
 }
 
-int main() {
-    WSADATA wsa;
-    sockaddr_in serverAddr, clientAddr;
+void parseArguments(int argc, char* argv[], ServerConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 10, "--backend=") == 0) {
+            config.backend = arg.substr(10);
+        }
+        else if (arg.compare(0, 10, "--threads=") == 0) {
+            config.eventLoopThreads = std::stoul(arg.substr(10));
+        }
+        else if (arg.compare(0, 14, "--write-batch=") == 0) {
+            config.writeBatchSize = std::stoul(arg.substr(14));
+        }
+        else if (arg.compare(0, 17, "--write-delay-us=") == 0) {
+            config.writeBatchDelayMicros = std::stoul(arg.substr(17));
+        }
+        else if (arg.compare(0, 19, "--persist-presence=") == 0) {
+            config.persistPresence = arg.substr(19) == "1";
+        }
+        else if (arg.compare(0, 12, "--token-ttl=") == 0) {
+            config.sessionTokenSeconds = std::stoul(arg.substr(12));
+        }
+        else if (arg.compare(0, 18, "--max-connections=") == 0) {
+            config.maxConnections = std::stoul(arg.substr(18));
+        }
+        else if (arg.compare(0, 10, "--backlog=") == 0) {
+            config.backlog = std::stoul(arg.substr(10));
+        }
+        else if (arg.compare(0, 15, "--hash-threads=") == 0) {
+            config.hashThreads = std::stoul(arg.substr(15));
+        }
+        else if (arg.compare(0, 18, "--hash-iterations=") == 0) {
+            config.hashIterations = std::stoul(arg.substr(18));
+        }
+        else if (arg.compare(0, 7, "--rate-") == 0) {
+            if (!parseRateLimit(arg.substr(7), config)) {
+                std::cerr << "Ignoring unknown rate class: " << arg << std::endl;
+            }
+        }
+        else if (arg.compare(0, 15, "--bench-parser=") == 0) {
+            config.benchParserPasses = std::stoul(arg.substr(15));
+        }
+        else {
+            std::cerr << "Ignoring unknown argument: " << arg << std::endl;
+        }
+    }
+
+#ifndef HAVE_IO_URING
+    if (config.backend == "io_uring") {
+        std::cerr << "io_uring is not available in this build, using " << DEFAULT_BACKEND << std::endl;
+        config.backend = DEFAULT_BACKEND;
+    }
+#endif
+
+    if (config.eventLoopThreads == 0) {
+        config.eventLoopThreads = std::thread::hardware_concurrency();
+        if (config.eventLoopThreads == 0) {
+            config.eventLoopThreads = 1;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    sockaddr_in serverAddr;
     sqlite3* db = nullptr;
+    ServerConfig config;
 
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        std::cerr << "Failed to initialize Winsock. Error: " << WSAGetLastError() << std::endl;
+    parseArguments(argc, argv, config);
+    if (config.benchParserPasses > 0) {
+        benchmarkParser(config.benchParserPasses);
+        return 0;
+    }
+
+    if (!startupSockets()) {
         return 1;
     }
 
     if (initializeDatabase(db) != 0) {
-        WSACleanup();
+        cleanupSockets();
         return 1;
     }
 
@@ -377,10 +4430,15 @@ int main() {
     if (serverSocket == INVALID_SOCKET) {
         std::cerr << "Could not create socket: " << WSAGetLastError() << std::endl;
         sqlite3_close(db);
-        WSACleanup();
+        cleanupSockets();
         return 1;
     }
 
+#ifndef _WIN32
+    int reuse = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_addr.s_addr = INADDR_ANY;
     serverAddr.sin_port = htons(SERVER_PORT);
@@ -389,35 +4447,67 @@ int main() {
         std::cerr << "Bind failed: " << WSAGetLastError() << std::endl;
         closesocket(serverSocket);
         sqlite3_close(db);
-        WSACleanup();
+        cleanupSockets();
         return 1;
     }
 
-    if (listen(serverSocket, MAX_PENDING) == SOCKET_ERROR) {
+    if (listen(serverSocket, (int)config.backlog) == SOCKET_ERROR) {
         std::cerr << "Listen failed: " << WSAGetLastError() << std::endl;
         closesocket(serverSocket);
         sqlite3_close(db);
-        WSACleanup();
+        cleanupSockets();
+        return 1;
+    }
+
+    // The read-write connection is only used by the writer thread
+    StatementCache statements;
+    if (!catalog.load(db) || !statements.prepare(db)) {
+        statements.clear();
+        closesocket(serverSocket);
+        sqlite3_close(db);
+        cleanupSockets();
         return 1;
     }
 
+    writer.start(db, statements, config.writeBatchSize, config.writeBatchDelayMicros);
+    presence.setPersistent(config.persistPresence);
+    tokens.setLifetime(config.sessionTokenSeconds);
+    hasher.start(config.hashThreads, config.hashIterations);
+    rateLimiter.configure(config.rateLimits);
+#ifndef _WIN32
+    fitDescriptorLimit(config);
+#endif
+    connectionLimit.setMaximum(config.maxConnections);
+    connectionLimit.reserveSpare();
+
     std::cout << "Server is listening on port " << SERVER_PORT << "..." << std::endl;
 
-    int clientAddrLen = sizeof(clientAddr);
-    while (true) {
-        SOCKET clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
-        if (clientSocket == INVALID_SOCKET) {
-            std::cerr << "Accept failed: " << WSAGetLastError() << std::endl;
-            continue;
+#ifdef HAVE_EPOLL
+    if (config.backend == "epoll" || config.backend == "io_uring") {
+        if (!runEventLoops(config)) {
+            hasher.stop();
+            writer.stop();
+            statements.clear();
+            closesocket(serverSocket);
+            sqlite3_close(db);
+            cleanupSockets();
+            return 1;
         }
-
-        int currentUserId = -1;
-        std::thread clientThread(handleClient, clientSocket, db, std::ref(currentUserId));
-        clientThread.detach();
+    }
+    else
+#endif
+    {
+        runThreadPerConnection();
     }
 
+#ifndef _WIN32
     closesocket(serverSocket);
+#endif
+    hasher.stop();
+    writer.stop();
+    readers.clear();
+    statements.clear();
     sqlite3_close(db);
-    WSACleanup();
+    cleanupSockets();
     return 0;
 }